@@ -0,0 +1,116 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+namespace Common
+{
+
+/* Distribution of non-negative values in power of 2 buckets: bucket 0 counts zeroes, bucket n counts values
+ * from 2^(n-1) up to 2^n - 1, and the last bucket also counts everything above that.
+ * Values are added by exactly one thread, any other thread can take snapshots while that happens.
+ */
+class Histogram
+{
+public:
+	constexpr static int BUCKETS = 24;
+
+	struct Snapshot
+	{
+		uint64_t buckets[BUCKETS] = {};
+		uint64_t count = 0;
+		uint64_t sum = 0;
+
+		double mean() const
+		{
+			return count ? (double)sum / count : 0;
+		}
+
+		//Upper bound of the bucket holding the value that the given fraction of all values are at or below
+		uint32_t percentile(double fraction) const
+		{
+			if (!count)
+			{
+				return 0;
+			}
+
+			uint64_t rank = std::min((uint64_t)(fraction * count), count - 1);
+			uint64_t seen = 0;
+			for (int i = 0; i < BUCKETS; i++)
+			{
+				seen += buckets[i];
+				if (seen > rank)
+				{
+					return bucket_max(i);
+				}
+			}
+
+			return 0;
+		}
+
+		//Everything added between an earlier snapshot and this one
+		Snapshot operator-(const Snapshot& earlier) const
+		{
+			Snapshot result;
+			for (int i = 0; i < BUCKETS; i++)
+			{
+				result.buckets[i] = buckets[i] - earlier.buckets[i];
+			}
+
+			result.count = count - earlier.count;
+			result.sum = sum - earlier.sum;
+			return result;
+		}
+	};
+
+	static uint32_t bucket_max(int bucket)
+	{
+		return bucket ? (uint32_t)((1ull << bucket) - 1) : 0;
+	}
+
+	Histogram()
+	{
+		for (auto& bucket : buckets)
+		{
+			bucket = 0;
+		}
+
+		count = 0;
+		sum = 0;
+	}
+
+	//Writer side only: with a single writer, nothing needs an atomic read-modify-write
+	void add(uint32_t value)
+	{
+		int bucket = 0;
+		for (uint32_t v = value; v && bucket < BUCKETS - 1; v >>= 1)
+		{
+			bucket++;
+		}
+
+		buckets[bucket].store(buckets[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	//The snapshot may be off by the values being added while it is taken
+	Snapshot snapshot() const
+	{
+		Snapshot result;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			result.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		}
+
+		result.count = count.load(std::memory_order_relaxed);
+		result.sum = sum.load(std::memory_order_relaxed);
+		return result;
+	}
+
+private:
+	std::atomic<uint64_t> buckets[BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+namespace Common
+{
+
+/* Fixed-capacity ring buffer shared between exactly one producer thread and one consumer thread.
+ * Neither side ever takes a lock. The capacity must be a power of 2.
+ */
+template <typename T>
+class SPSCQueue
+{
+private:
+	std::unique_ptr<T[]> slots;
+	size_t mask;
+
+	//Each index is only written by one side, so they live on separate cache lines to avoid false sharing
+	alignas(64) std::atomic<size_t> write_index;
+	alignas(64) std::atomic<size_t> read_index;
+
+public:
+	SPSCQueue(size_t capacity)
+	{
+		assert(capacity && !(capacity & (capacity - 1)));
+		slots = std::make_unique<T[]>(capacity);
+		mask = capacity - 1;
+		write_index = 0;
+		read_index = 0;
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+
+	size_t size() const
+	{
+		return write_index.load(std::memory_order_acquire) - read_index.load(std::memory_order_acquire);
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	//Producer side: returns the next free slot, or null if the queue is full
+	//The slot is only visible to the consumer once commit_write() is called
+	T* write_slot()
+	{
+		size_t index = write_index.load(std::memory_order_relaxed);
+		if (index - read_index.load(std::memory_order_acquire) > mask)
+		{
+			return nullptr;
+		}
+
+		return &slots[index & mask];
+	}
+
+	void commit_write()
+	{
+		write_index.store(write_index.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool push(const T& value)
+	{
+		T* slot = write_slot();
+		if (!slot)
+		{
+			return false;
+		}
+
+		*slot = value;
+		commit_write();
+		return true;
+	}
+
+	//Producer side: copies in as many values as fit, returns how many were written
+	//They all become visible to the consumer at once
+	size_t write(const T* values, size_t count)
+	{
+		size_t index = write_index.load(std::memory_order_relaxed);
+		size_t free = capacity() - (index - read_index.load(std::memory_order_acquire));
+		count = std::min(count, free);
+
+		size_t first = std::min(count, capacity() - (index & mask));
+		std::copy(values, values + first, &slots[index & mask]);
+		std::copy(values + first, values + count, &slots[0]);
+
+		write_index.store(index + count, std::memory_order_release);
+		return count;
+	}
+
+	//Consumer side: returns the oldest queued slot, or null if the queue is empty
+	//The slot stays valid until commit_read() hands it back to the producer
+	T* read_slot()
+	{
+		size_t index = read_index.load(std::memory_order_relaxed);
+		if (index == write_index.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+
+		return &slots[index & mask];
+	}
+
+	void commit_read()
+	{
+		read_index.store(read_index.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool pop(T& value)
+	{
+		T* slot = read_slot();
+		if (!slot)
+		{
+			return false;
+		}
+
+		value = *slot;
+		commit_read();
+		return true;
+	}
+
+	//Consumer side: copies out up to count of the oldest values, returns how many were read
+	size_t read(T* values, size_t count)
+	{
+		size_t index = read_index.load(std::memory_order_relaxed);
+		size_t used = write_index.load(std::memory_order_acquire) - index;
+		count = std::min(count, used);
+
+		size_t first = std::min(count, capacity() - (index & mask));
+		std::copy(&slots[index & mask], &slots[index & mask] + first, values);
+		std::copy(&slots[0], &slots[0] + (count - first), values + first);
+
+		read_index.store(index + count, std::memory_order_release);
+		return count;
+	}
+
+	//Consumer side: the value index places after the oldest one, without removing anything
+	//The index must be below size()
+	const T& peek(size_t index) const
+	{
+		return slots[(read_index.load(std::memory_order_relaxed) + index) & mask];
+	}
+
+	//Consumer side: drops everything that is queued
+	void clear()
+	{
+		read_index.store(write_index.load(std::memory_order_acquire), std::memory_order_release);
+	}
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,153 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace Common
+{
+
+/* Save states are flat binaries of tagged sections, each holding one module's fields in a fixed order.
+ * Sections record their size, so that a state with a different layout is rejected instead of being misread.
+ * Values are stored in host byte order, states aren't meant to be moved between hosts.
+ */
+class StateWriter
+{
+public:
+	//The buffer is cleared but keeps its capacity, so that writing states over and over doesn't allocate
+	StateWriter(std::vector<uint8_t>& buffer) : buffer(buffer)
+	{
+		buffer.clear();
+		section_start = 0;
+	}
+
+	void begin_section(const char* tag)
+	{
+		assert(strlen(tag) == 4);
+		write_bytes(tag, 4);
+
+		//The size is filled in once the section ends
+		section_start = buffer.size();
+		write<uint32_t>(0);
+	}
+
+	void end_section()
+	{
+		uint32_t size = (uint32_t)(buffer.size() - section_start - 4);
+		memcpy(&buffer[section_start], &size, 4);
+	}
+
+	void write_bytes(const void* data, size_t size)
+	{
+		const uint8_t* bytes = (const uint8_t*)data;
+		buffer.insert(buffer.end(), bytes, bytes + size);
+	}
+
+	template <typename T> void write(const T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		write_bytes(&value, sizeof(T));
+	}
+
+private:
+	std::vector<uint8_t>& buffer;
+	size_t section_start;
+};
+
+/* Reads back what StateWriter wrote. Any mismatch makes the reader fail, after which reads return zeroes,
+ * so loaders can read everything first and check good() once at the end.
+ */
+class StateReader
+{
+public:
+	StateReader(const uint8_t* data, size_t size) : data(data), size(size)
+	{
+		pos = 0;
+		section_end = 0;
+		failed = false;
+	}
+
+	bool good() const
+	{
+		return !failed;
+	}
+
+	void fail()
+	{
+		failed = true;
+	}
+
+	//Fails unless the next section has the given tag
+	bool begin_section(const char* tag)
+	{
+		assert(strlen(tag) == 4);
+		char found[4];
+		read_bytes(found, 4);
+		uint32_t section_size = read<uint32_t>();
+
+		if (failed || memcmp(found, tag, 4) || section_size > size - pos)
+		{
+			failed = true;
+			return false;
+		}
+
+		section_end = pos + section_size;
+		return true;
+	}
+
+	//Fails unless exactly the whole section was read
+	bool end_section()
+	{
+		if (pos != section_end)
+		{
+			failed = true;
+		}
+
+		return !failed;
+	}
+
+	//Moves past whatever is left of the section, for data that isn't needed
+	void skip_section()
+	{
+		if (!failed)
+		{
+			pos = section_end;
+		}
+	}
+
+	void read_bytes(void* dst, size_t count)
+	{
+		if (failed || count > size - pos)
+		{
+			failed = true;
+			memset(dst, 0, count);
+			return;
+		}
+
+		memcpy(dst, data + pos, count);
+		pos += count;
+	}
+
+	template <typename T> void read(T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		read_bytes(&value, sizeof(T));
+	}
+
+	template <typename T> T read()
+	{
+		T value;
+		read(value);
+		return value;
+	}
+
+private:
+	const uint8_t* data;
+	size_t size;
+	size_t pos;
+	size_t section_end;
+	bool failed;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+
+namespace Common
+{
+
+/* Hands the newest of a series of values from one producer thread to one consumer thread.
+ * Each side always owns a buffer of its own, so neither ever waits for the other, and values
+ * the consumer was too slow to pick up are simply dropped.
+ */
+template <typename T>
+class TripleBuffer
+{
+private:
+	T buffers[3];
+
+	//Buffer owned by each side
+	int back;
+	int front;
+
+	//Buffer waiting to be picked up by the consumer, with NEW_BIT set if it was published since the last pickup
+	constexpr static int NEW_BIT = 0x4;
+	std::atomic<int> ready;
+
+public:
+	TripleBuffer(const T& initial_value)
+	{
+		for (T& buffer : buffers)
+		{
+			buffer = initial_value;
+		}
+
+		back = 0;
+		ready = 1;
+		front = 2;
+	}
+
+	//Producer side: the buffer to write the next value to
+	T& get_back()
+	{
+		return buffers[back];
+	}
+
+	//Producer side: makes the back buffer the newest value and takes over the one it replaces
+	void publish()
+	{
+		int prev = ready.exchange(back | NEW_BIT, std::memory_order_acq_rel);
+		back = prev & ~NEW_BIT;
+	}
+
+	//Consumer side: picks up the newest value if there is one, returns false if get_front() is unchanged
+	bool update()
+	{
+		if (!(ready.load(std::memory_order_relaxed) & NEW_BIT))
+		{
+			return false;
+		}
+
+		int prev = ready.exchange(front, std::memory_order_acq_rel);
+		front = prev & ~NEW_BIT;
+		return true;
+	}
+
+	//Consumer side: the newest value picked up by update()
+	const T& get_front() const
+	{
+		return buffers[front];
+	}
+};
+
+}
\ No newline at end of file
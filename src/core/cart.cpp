@@ -1,5 +1,7 @@
+#include <cstdio>
 #include <fstream>
 #include <string>
+#include <common/state.h>
 #include "core/cart.h"
 #include "core/memory.h"
 
@@ -11,10 +13,23 @@ struct State
 	std::vector<uint8_t> rom;
 	std::vector<uint8_t> sram;
 	std::string sram_file_path;
+	uint32_t rom_checksum;
 };
 
 static State state;
 
+static uint32_t calc_checksum(std::vector<uint8_t>& data)
+{
+	//FNV-1a
+	uint32_t hash = 0x811C9DC5;
+	for (uint8_t value : data)
+	{
+		hash = (hash ^ value) * 0x01000193;
+	}
+
+	return hash;
+}
+
 static void commit_sram()
 {
 	std::ofstream file(state.sram_file_path, std::ios::binary);
@@ -42,6 +57,8 @@ void initialize(Config::CartInfo& info)
 		state.sram.resize(new_size, 0xFF);
 	}
 
+	state.rom_checksum = calc_checksum(state.rom);
+
 	Memory::map_sh2_pagetable(state.rom.data(), ROM_START, state.rom.size());
 	Memory::map_sh2_pagetable(state.sram.data(), SRAM_START, state.sram.size());
 }
@@ -67,4 +84,35 @@ void sram_commit_check()
 	commit_sram();
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("CART");
+	writer.write<uint32_t>(state.rom.size());
+	writer.write(state.rom_checksum);
+	writer.write<uint32_t>(state.sram.size());
+	writer.write_bytes(state.sram.data(), state.sram.size());
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (!reader.begin_section("CART"))
+	{
+		return;
+	}
+
+	uint32_t rom_size = reader.read<uint32_t>();
+	uint32_t rom_checksum = reader.read<uint32_t>();
+	uint32_t sram_size = reader.read<uint32_t>();
+	if (rom_size != state.rom.size() || rom_checksum != state.rom_checksum || sram_size != state.sram.size())
+	{
+		printf("[Cart] state is from a different game\n");
+		reader.fail();
+		return;
+	}
+
+	reader.read_bytes(state.sram.data(), sram_size);
+	reader.end_section();
+}
+
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 #include "core/config.h"
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace Cart
 {
 
@@ -12,4 +18,8 @@ void shutdown();
 
 void sram_commit_check();
 
+//Holds SRAM, and a checksum of the ROM so that states from other games are rejected
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
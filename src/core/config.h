@@ -13,9 +13,57 @@ struct CartInfo
 	std::string sram_file_path;
 };
 
+struct VideoInfo
+{
+	//Composites scanlines on a separate thread while the CPU keeps running
+	bool threaded_render;
+};
+
+struct SoundInfo
+{
+	//Synthesizes sound on the emulation thread in step with emulated time, the audio device only copies it out
+	bool lockstep;
+	//Renders audio in lockstep without an audio device, instead of playing it
+	bool offline;
+	//WAV file that offline audio is streamed to
+	std::string wav_file_path;
+
+	//Output format requested from the audio device, SDL converts unsupported formats internally
+	//44100-48000Hz provides good quality
+	int sample_rate = 48000;
+	//Smaller buffer gives lower latency, larger buffer allows smoother timing with time reference
+	//A good compromise is around 50ms, slower hosts may need more to avoid underruns
+	int buffer_size = 2048;
+
+	//Time reference to smooth out audio timing at larger buffer sizes, assumes consistent CPU timing
+	//It is only used if it updates more often than the audio device asks for buffers
+	int timeref_frequency = 100;
+
+	//Final mix level after amplification circuit
+	//Comfortable listening level is around 0.7 to 0.8, typical hardware level 0.62
+	float mix_level = 0.7f;
+	//Approximates the hardware's resonant low pass filter, and removes DC offset
+	bool filter_enable = true;
+
+	//Fade up/down time in milliseconds when sound is muted e.g. by minimizing the window
+	int mute_fade_ms = 20;
+};
+
+struct RewindInfo
+{
+	//Memory that snapshots may take up in total, the oldest ones are dropped to stay within it
+	//Rewinding is disabled if this is 0
+	size_t buffer_size = 0;
+	//Emulated frames between snapshots, each step back goes back this far
+	int interval = 2;
+};
+
 struct SystemInfo
 {
 	CartInfo cart;
+	VideoInfo video;
+	SoundInfo sound;
+	RewindInfo rewind;
 	std::vector<uint8_t> bios_rom;
 	std::vector<uint8_t> sound_rom;
 };
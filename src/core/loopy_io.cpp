@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cstdio>
+#include <common/state.h>
 #include "core/loopy_io.h"
 
 namespace LoopyIO
@@ -83,4 +84,24 @@ void update_pad(int key_info, bool pressed)
 	}
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("IO  ");
+	writer.write(state);
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (!reader.begin_section("IO  "))
+	{
+		return;
+	}
+
+	//The pad follows the buttons held on the host right now, so it isn't rolled back with the rest
+	State saved;
+	reader.read(saved);
+	reader.end_section();
+}
+
 }
\ No newline at end of file
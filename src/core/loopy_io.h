@@ -1,6 +1,12 @@
 #pragma once
 #include <cstdint>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace LoopyIO
 {
 
@@ -20,4 +26,7 @@ void reg_write32(uint32_t addr, uint32_t value);
 
 void update_pad(int key_info, bool pressed);
 
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <cstring>
 #include <memory>
+#include <common/state.h>
 #include "core/memory.h"
 
 namespace Memory
@@ -14,6 +15,7 @@ constexpr static int SH2_REGION_SIZE = 1 << 24;
 struct State
 {
 	std::vector<uint8_t*> sh2_pagetable;
+	std::vector<uint8_t*> sh2_write_pagetable;
 
 	uint8_t bios[BIOS_SIZE];
 	uint8_t ram[RAM_SIZE];
@@ -28,7 +30,8 @@ static void map_pagetable(std::vector<uint8_t*>& table, uint8_t* data, uint32_t
 
 	for (unsigned int i = 0; i < size; i++)
 	{
-		table[start + i] = data + (i << 12);
+		//A null pointer unmaps the range
+		table[start + i] = data ? data + (i << 12) : nullptr;
 	}
 }
 
@@ -41,6 +44,9 @@ void initialize(std::vector<uint8_t>& bios_rom)
 	state->sh2_pagetable.resize(SH2_PAGETABLE_SIZE);
 	std::fill(state->sh2_pagetable.begin(), state->sh2_pagetable.end(), nullptr);
 
+	state->sh2_write_pagetable.resize(SH2_PAGETABLE_SIZE);
+	std::fill(state->sh2_write_pagetable.begin(), state->sh2_write_pagetable.end(), nullptr);
+
 	map_sh2_pagetable(state->bios, BIOS_START, BIOS_SIZE);
 
 	//Mirror RAM to its entire region
@@ -60,6 +66,14 @@ void shutdown()
 void map_sh2_pagetable(uint8_t* data, uint32_t start, uint32_t size)
 {
 	map_pagetable(state->sh2_pagetable, data, start, size);
+	map_pagetable(state->sh2_write_pagetable, data, start, size);
+}
+
+void map_sh2_read_pagetable(uint8_t* data, uint32_t start, uint32_t size)
+{
+	//Writes to these pages fall through to the MMIO handlers, so the owner can observe them
+	map_pagetable(state->sh2_pagetable, data, start, size);
+	map_pagetable(state->sh2_write_pagetable, nullptr, start, size);
 }
 
 uint8_t** get_sh2_pagetable()
@@ -67,4 +81,25 @@ uint8_t** get_sh2_pagetable()
 	return state->sh2_pagetable.data();
 }
 
+uint8_t** get_sh2_write_pagetable()
+{
+	return state->sh2_write_pagetable.data();
+}
+
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("RAM ");
+	writer.write(state->ram);
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (reader.begin_section("RAM "))
+	{
+		reader.read(state->ram);
+		reader.end_section();
+	}
+}
+
 }
\ No newline at end of file
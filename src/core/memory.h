@@ -2,6 +2,12 @@
 #include <cstdint>
 #include <vector>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace Memory
 {
 
@@ -17,6 +23,12 @@ void initialize(std::vector<uint8_t>& bios_rom);
 void shutdown();
 
 void map_sh2_pagetable(uint8_t* data, uint32_t start, uint32_t size);
+void map_sh2_read_pagetable(uint8_t* data, uint32_t start, uint32_t size);
 uint8_t** get_sh2_pagetable();
+uint8_t** get_sh2_write_pagetable();
+
+//Only RAM, the BIOS is read-only and the rest of the address space belongs to other modules
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
 
 }
\ No newline at end of file
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "core/rewind.h"
+#include "core/system.h"
+
+namespace Rewind
+{
+
+/* Only the newest snapshot is kept in full. Every older one is stored as the XOR of itself and the snapshot after it,
+ * which is mostly zeroes as little of RAM and VRAM changes between frames, and those zeroes are run-length compressed.
+ * Stepping back loads the newest snapshot and then undoes its delta to get the one before it.
+ */
+
+//Magic and version in front of the sections, see System::save_state
+constexpr static size_t STATE_HEADER_SIZE = 12;
+
+//Shorter runs of zeroes are stored within literals, as starting a new run costs about as much
+constexpr static size_t MIN_ZERO_RUN = 4;
+
+struct Span
+{
+	size_t offset;
+	size_t size;
+};
+
+struct WorkerState
+{
+	std::thread thread;
+	bool running;
+
+	std::mutex mutex;
+	//Wakes the worker when a snapshot is handed to it, and the emulation thread when the worker is done with it
+	std::condition_variable wake;
+	std::condition_variable idle;
+
+	//Snapshot taken by the emulation thread that the worker hasn't picked up yet
+	std::vector<uint8_t> pending;
+	bool pending_ready;
+	bool busy;
+
+	std::vector<uint8_t> newest;
+	std::deque<std::vector<uint8_t>> deltas;
+	size_t bytes;
+};
+
+static Config::RewindInfo config;
+static std::unique_ptr<WorkerState> worker;
+
+//Only used on the emulation thread
+static std::vector<uint8_t> capture;
+static std::vector<uint8_t> decode_buffer;
+static int frames_since_snapshot;
+
+static void write_varint(std::vector<uint8_t>& out, size_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+
+	out.push_back((uint8_t)value);
+}
+
+static size_t read_varint(const uint8_t*& data)
+{
+	size_t value = 0;
+	int shift = 0;
+	while (*data & 0x80)
+	{
+		value |= (size_t)(*data++ & 0x7F) << shift;
+		shift += 7;
+	}
+
+	value |= (size_t)*data++ << shift;
+	return value;
+}
+
+static size_t skip_zeroes(const uint8_t* data, size_t pos, size_t size)
+{
+	//Deltas are mostly zeroes, so check 8 bytes at a time
+	while (pos + 8 <= size)
+	{
+		uint64_t word;
+		memcpy(&word, data + pos, 8);
+		if (word)
+		{
+			break;
+		}
+		pos += 8;
+	}
+
+	while (pos < size && !data[pos])
+	{
+		pos++;
+	}
+
+	return pos;
+}
+
+//Stores the data as alternating runs of zeroes and literal bytes, each preceded by its length
+static void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+	size_t pos = 0;
+	while (pos < size)
+	{
+		size_t start = pos;
+		pos = skip_zeroes(data, pos, size);
+		write_varint(out, pos - start);
+
+		start = pos;
+		while (pos < size)
+		{
+			if (data[pos])
+			{
+				pos++;
+				continue;
+			}
+
+			size_t end = skip_zeroes(data, pos, size);
+			if (end - pos >= MIN_ZERO_RUN || end == size)
+			{
+				break;
+			}
+			pos = end;
+		}
+
+		write_varint(out, pos - start);
+		out.insert(out.end(), data + start, data + pos);
+	}
+}
+
+static void decompress(const uint8_t* data, uint8_t* out, size_t size)
+{
+	size_t pos = 0;
+	while (pos < size)
+	{
+		size_t zeroes = read_varint(data);
+		memset(out + pos, 0, zeroes);
+		pos += zeroes;
+
+		size_t literals = read_varint(data);
+		memcpy(out + pos, data, literals);
+		data += literals;
+		pos += literals;
+	}
+
+	assert(pos == size);
+}
+
+//Splits a state into its header and sections, so that deltas still line up after a section changed size
+static void split_sections(const std::vector<uint8_t>& state, std::vector<Span>& spans)
+{
+	spans.clear();
+	spans.push_back({ 0, STATE_HEADER_SIZE });
+
+	size_t pos = STATE_HEADER_SIZE;
+	while (pos + 8 <= state.size())
+	{
+		uint32_t size;
+		memcpy(&size, &state[pos + 4], 4);
+		spans.push_back({ pos, 8 + (size_t)size });
+		pos += 8 + size;
+	}
+
+	assert(pos == state.size());
+}
+
+//XORs every section of dst with the same section of src, bytes past the end of a section in src are left as they are
+static void xor_sections(std::vector<uint8_t>& dst, const std::vector<Span>& dst_spans,
+	const std::vector<uint8_t>& src, const std::vector<Span>& src_spans)
+{
+	for (size_t i = 0; i < dst_spans.size() && i < src_spans.size(); i++)
+	{
+		uint8_t* d = dst.data() + dst_spans[i].offset;
+		const uint8_t* s = src.data() + src_spans[i].offset;
+		size_t size = std::min(dst_spans[i].size, src_spans[i].size);
+
+		//Bytes can't be assumed not to alias, so the compiler won't do this a word at a time by itself
+		size_t j = 0;
+		for (; j + 8 <= size; j += 8)
+		{
+			uint64_t a, b;
+			memcpy(&a, d + j, 8);
+			memcpy(&b, s + j, 8);
+			a ^= b;
+			memcpy(d + j, &a, 8);
+		}
+
+		for (; j < size; j++)
+		{
+			d[j] ^= s[j];
+		}
+	}
+}
+
+//Turns older into the delta that gets it back from newer, as the section sizes of older followed by the compressed XOR
+static void encode_delta(std::vector<uint8_t>& older, const std::vector<uint8_t>& newer, std::vector<uint8_t>& out)
+{
+	static std::vector<Span> older_spans, newer_spans;
+	split_sections(older, older_spans);
+	split_sections(newer, newer_spans);
+	xor_sections(older, older_spans, newer, newer_spans);
+
+	out.clear();
+	write_varint(out, older_spans.size());
+	for (Span& span : older_spans)
+	{
+		write_varint(out, span.size);
+	}
+
+	compress(older.data(), older.size(), out);
+}
+
+static void decode_delta(const std::vector<uint8_t>& delta, const std::vector<uint8_t>& newer, std::vector<uint8_t>& older)
+{
+	static std::vector<Span> older_spans, newer_spans;
+	const uint8_t* data = delta.data();
+
+	older_spans.clear();
+	size_t count = read_varint(data);
+	size_t offset = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t size = read_varint(data);
+		older_spans.push_back({ offset, size });
+		offset += size;
+	}
+
+	older.resize(offset);
+	decompress(data, older.data(), older.size());
+
+	split_sections(newer, newer_spans);
+	xor_sections(older, older_spans, newer, newer_spans);
+}
+
+//Drops the oldest snapshots until everything fits in the buffer again
+static void trim()
+{
+	while (worker->bytes > config.buffer_size && !worker->deltas.empty())
+	{
+		worker->bytes -= worker->deltas.front().size();
+		worker->deltas.pop_front();
+	}
+}
+
+static void worker_main()
+{
+	std::vector<uint8_t> snapshot;
+	std::vector<uint8_t> encoded;
+
+	std::unique_lock<std::mutex> lock(worker->mutex);
+	while (true)
+	{
+		worker->wake.wait(lock, [] { return worker->pending_ready || !worker->running; });
+		if (!worker->running)
+		{
+			return;
+		}
+
+		snapshot.swap(worker->pending);
+		worker->pending_ready = false;
+		worker->busy = true;
+
+		//The emulation thread leaves newest alone while the worker is busy
+		lock.unlock();
+		bool has_delta = !worker->newest.empty();
+		if (has_delta)
+		{
+			encode_delta(worker->newest, snapshot, encoded);
+		}
+		lock.lock();
+
+		if (has_delta)
+		{
+			worker->bytes += encoded.size();
+			worker->deltas.emplace_back(encoded.begin(), encoded.end());
+		}
+
+		worker->bytes -= worker->newest.size();
+		worker->bytes += snapshot.size();
+		worker->newest.swap(snapshot);
+		trim();
+
+		worker->busy = false;
+		worker->idle.notify_all();
+	}
+}
+
+void initialize(Config::RewindInfo& info)
+{
+	config = info;
+	config.interval = std::max(config.interval, 1);
+	frames_since_snapshot = 0;
+
+	if (!config.buffer_size)
+	{
+		return;
+	}
+
+	worker = std::make_unique<WorkerState>();
+	worker->running = true;
+	worker->pending_ready = false;
+	worker->busy = false;
+	worker->bytes = 0;
+	worker->thread = std::thread(worker_main);
+
+	printf("[Rewind] snapshot every %d frames, %zu KB buffer\n", config.interval, config.buffer_size / 1024);
+}
+
+void shutdown()
+{
+	if (!worker)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		worker->running = false;
+		worker->wake.notify_one();
+	}
+
+	worker->thread.join();
+	worker = nullptr;
+}
+
+bool is_enabled()
+{
+	return worker != nullptr;
+}
+
+void frame_end()
+{
+	if (!worker || ++frames_since_snapshot < config.interval)
+	{
+		return;
+	}
+
+	frames_since_snapshot = 0;
+	System::save_state(capture);
+
+	//If the worker is still busy with the previous snapshot, that one is replaced by this one
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	capture.swap(worker->pending);
+	worker->pending_ready = true;
+	worker->wake.notify_one();
+}
+
+bool step_back()
+{
+	if (!worker)
+	{
+		return false;
+	}
+
+	//The newest snapshot may still be on its way
+	std::unique_lock<std::mutex> lock(worker->mutex);
+	worker->idle.wait(lock, [] { return !worker->pending_ready && !worker->busy; });
+
+	if (worker->newest.empty())
+	{
+		return false;
+	}
+
+	bool loaded = System::load_state(worker->newest);
+	frames_since_snapshot = 0;
+
+	worker->bytes -= worker->newest.size();
+	if (worker->deltas.empty())
+	{
+		worker->newest.clear();
+		return loaded;
+	}
+
+	decode_delta(worker->deltas.back(), worker->newest, decode_buffer);
+	worker->newest.swap(decode_buffer);
+	worker->bytes += worker->newest.size();
+	worker->bytes -= worker->deltas.back().size();
+	worker->deltas.pop_back();
+	return loaded;
+}
+
+Stats get_stats()
+{
+	Stats stats = {};
+	if (!worker)
+	{
+		return stats;
+	}
+
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	stats.snapshots = worker->deltas.size() + !worker->newest.empty();
+	stats.bytes = worker->bytes;
+	stats.frames = (int)worker->deltas.size() * config.interval;
+	return stats;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include "core/config.h"
+
+namespace Rewind
+{
+
+void initialize(Config::RewindInfo& config);
+void shutdown();
+
+bool is_enabled();
+
+//Call on the emulation thread after every frame that moves forward, every interval-th one is snapshotted
+//Snapshots are compressed on a separate thread, so this costs little more than a save state
+void frame_end();
+
+//Loads the newest snapshot and forgets it, so that each call goes further back
+//Returns false when there is nothing left to go back to
+bool step_back();
+
+struct Stats
+{
+	size_t snapshots;
+	//Memory taken up by all snapshots
+	size_t bytes;
+	//Emulated frames that can be rewound
+	int frames;
+};
+
+Stats get_stats();
+
+}
\ No newline at end of file
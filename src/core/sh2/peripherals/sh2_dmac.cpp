@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <cassert>
+#include <common/state.h>
+#include <video/video.h>
 #include "core/sh2/peripherals/sh2_dmac.h"
 #include "core/sh2/sh2_bus.h"
 
@@ -100,6 +103,24 @@ void Channel::start_transfer()
 	{
 		while (transfer_size && state.dreqs[ctrl.mode])
 		{
+			//A run of writes to consecutive VDP DMA triggers is a bulk fill, so do the whole run at once
+			uint32_t dst = SH2::Bus::translate_addr(dst_addr);
+			if (dst_step == 2 && dst >= Video::DMA_START && dst < Video::DMA_END)
+			{
+				uint32_t count = std::min(transfer_size, (Video::DMA_END - dst) >> 1);
+				for (uint32_t i = 0; i < count; i++)
+				{
+					//The value written doesn't matter, but the source may still have side effects
+					SH2::Bus::read16(src_addr);
+					src_addr += src_step;
+				}
+
+				Video::dma_fill(dst, count);
+				dst_addr += dst_step * count;
+				transfer_size -= count;
+				continue;
+			}
+
 			uint16_t value = SH2::Bus::read16(src_addr);
 			SH2::Bus::write16(dst_addr, value);
 
@@ -235,4 +256,20 @@ void clear_dreq(DREQ dreq)
 	state.dreqs[(int)dreq] = false;
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("DMAC");
+	writer.write(state);
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (reader.begin_section("DMAC"))
+	{
+		reader.read(state);
+		reader.end_section();
+	}
+}
+
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 #include <cstdint>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace SH2::OCPM::DMAC
 {
 
@@ -39,4 +45,7 @@ uint16_t read16(uint32_t addr);
 void write16(uint32_t addr, uint16_t value);
 void write32(uint32_t addr, uint32_t value);
 
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
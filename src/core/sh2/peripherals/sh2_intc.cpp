@@ -1,4 +1,5 @@
 #include <cassert>
+#include <common/state.h>
 #include "core/sh2/peripherals/sh2_intc.h"
 #include "core/sh2/sh2_local.h"
 
@@ -223,4 +224,20 @@ void deassert_irq(IRQ irq)
 	send_irq_signal();
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("INTC");
+	writer.write(state);
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (reader.begin_section("INTC"))
+	{
+		reader.read(state);
+		reader.end_section();
+	}
+}
+
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 #include <cstdint>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace SH2::OCPM::INTC
 {
 
@@ -51,4 +57,7 @@ void write16(uint32_t addr, uint16_t value);
 void assert_irq(IRQ irq, int vector_offs);
 void deassert_irq(IRQ irq);
 
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cstring>
 #include <common/bswp.h>
+#include <common/state.h>
 #include "core/sh2/peripherals/sh2_dmac.h"
 #include "core/sh2/peripherals/sh2_intc.h"
 #include "core/sh2/peripherals/sh2_ocpm.h"
@@ -197,4 +198,20 @@ void oram_write32(uint32_t addr, uint32_t value)
 	memcpy(&oram[addr & 0x3FF], &value, 4);
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("ORAM");
+	writer.write(oram);
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (reader.begin_section("ORAM"))
+	{
+		reader.read(oram);
+		reader.end_section();
+	}
+}
+
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 #include <cstdint>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace SH2::OCPM
 {
 
@@ -26,4 +32,8 @@ void oram_write8(uint32_t addr, uint8_t value);
 void oram_write16(uint32_t addr, uint16_t value);
 void oram_write32(uint32_t addr, uint32_t value);
 
+//On-chip RAM only, each peripheral saves its own state
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
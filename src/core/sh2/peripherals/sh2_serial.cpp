@@ -2,6 +2,7 @@
 #include <cstdio>
 #include <functional>
 
+#include <common/state.h>
 #include <sound/sound.h>
 #include "core/sh2/peripherals/sh2_dmac.h"
 #include "core/sh2/peripherals/sh2_serial.h"
@@ -80,7 +81,7 @@ struct Port
 	void sched_tx_ev()
 	{
 		Timing::UnitCycle sched_cycles = Timing::convert_cpu(cycles_per_bit);
-		tx_ev = Timing::add_event(tx_ev_func, sched_cycles, (uint64_t)this, Timing::CPU_TIMER);
+		tx_ev = Timing::add_event(tx_ev_func, sched_cycles, id, Timing::CPU_TIMER);
 	}
 };
 
@@ -105,7 +106,7 @@ static void check_tx_dreqs()
 static void tx_event(uint64_t param, int cycles_late)
 {
 	assert(!cycles_late);
-	Port* port = (Port*)param;
+	Port* port = &state.ports[param];
 
 	bool bit = port->tx_shift_reg & 0x1;
 	port->tx_shift_reg >>= 1;
@@ -240,4 +241,47 @@ void set_tx_callback(int port, std::function<void(uint8_t)> callback)
 	state.ports[port].tx_callback = callback;
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	//The callbacks are connections to other modules and stay as they are
+	writer.begin_section("SCI ");
+	for (auto& port : state.ports)
+	{
+		writer.write(port.tx_ev);
+		writer.write(port.bit_factor);
+		writer.write(port.cycles_per_bit);
+		writer.write(port.mode);
+		writer.write(port.ctrl);
+		writer.write(port.status);
+		writer.write(port.tx_bits_left);
+		writer.write(port.tx_shift_reg);
+		writer.write(port.tx_buffer);
+		writer.write(port.tx_prepared_data);
+	}
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (!reader.begin_section("SCI "))
+	{
+		return;
+	}
+
+	for (auto& port : state.ports)
+	{
+		reader.read(port.tx_ev);
+		reader.read(port.bit_factor);
+		reader.read(port.cycles_per_bit);
+		reader.read(port.mode);
+		reader.read(port.ctrl);
+		reader.read(port.status);
+		reader.read(port.tx_bits_left);
+		reader.read(port.tx_shift_reg);
+		reader.read(port.tx_buffer);
+		reader.read(port.tx_prepared_data);
+	}
+	reader.end_section();
+}
+
 }
\ No newline at end of file
@@ -2,6 +2,12 @@
 #include <cstdint>
 #include <functional>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace SH2::OCPM::Serial
 {
 
@@ -13,4 +19,8 @@ void write8(uint32_t addr, uint8_t value);
 
 void set_tx_callback(int port, std::function<void(uint8_t)> callback);
 
+//Includes bytes that are still being shifted out
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
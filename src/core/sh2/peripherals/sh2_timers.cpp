@@ -1,6 +1,7 @@
 #include <cassert>
 #include <cstdio>
 #include <tuple>
+#include <common/state.h>
 #include "core/sh2/peripherals/sh2_intc.h"
 #include "core/sh2/peripherals/sh2_timers.h"
 #include "core/timing.h"
@@ -84,7 +85,7 @@ struct Timer
 
 		uint32_t cycles = (nearest_target - counter) << ctrl.clock;
 		Timing::UnitCycle sched_cycles = Timing::convert_cpu(cycles);
-		ev = Timing::add_event(ev_func, sched_cycles, (uint64_t)this, Timing::CPU_TIMER);
+		ev = Timing::add_event(ev_func, sched_cycles, id, Timing::CPU_TIMER);
 
 		time_when_started = Timing::get_timestamp(Timing::CPU_TIMER);
 		counter_when_started = counter;
@@ -139,7 +140,7 @@ static void update_timer_target(Timer* timer)
 static void intr_event(uint64_t param, int cycles_late)
 {
 	assert(!cycles_late);
-	Timer* timer = (Timer*)param;
+	Timer* timer = &state.timers[param];
 
 	timer->update_counter();
 
@@ -383,4 +384,20 @@ void write16(uint32_t addr, uint16_t value)
 	}
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("ITU ");
+	writer.write(state);
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (reader.begin_section("ITU "))
+	{
+		reader.read(state);
+		reader.end_section();
+	}
+}
+
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 #include <cstdint>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace SH2::OCPM::Timer
 {
 
@@ -12,4 +18,7 @@ uint16_t read16(uint32_t addr);
 void write8(uint32_t addr, uint8_t value);
 void write16(uint32_t addr, uint16_t value);
 
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
@@ -1,8 +1,10 @@
 #include <algorithm>
 #include <cassert>
 #include <common/bswp.h>
+#include <common/state.h>
 #include "core/sh2/peripherals/sh2_dmac.h"
 #include "core/sh2/peripherals/sh2_intc.h"
+#include "core/sh2/peripherals/sh2_ocpm.h"
 #include "core/sh2/peripherals/sh2_serial.h"
 #include "core/sh2/peripherals/sh2_timers.h"
 #include "core/sh2/sh2.h"
@@ -50,6 +52,7 @@ void initialize()
 	sh2 = {};
 
 	sh2.pagetable = Memory::get_sh2_pagetable();
+	sh2.write_pagetable = Memory::get_sh2_write_pagetable();
 
 	//TODO: set this to a reset vector
 	set_pc(0x0E000480);
@@ -70,9 +73,57 @@ void shutdown()
 	//nop
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	//The pagetables belong to Memory and don't change
+	writer.begin_section("SH2 ");
+	writer.write(sh2.gpr);
+	writer.write(sh2.pc);
+	writer.write(sh2.pr);
+	writer.write(sh2.macl);
+	writer.write(sh2.mach);
+	writer.write(sh2.gbr);
+	writer.write(sh2.vbr);
+	writer.write(sh2.sr);
+	writer.write(sh2.pending_irq_prio);
+	writer.write(sh2.pending_irq_vector);
+	writer.end_section();
+
+	OCPM::save_state(writer);
+	OCPM::DMAC::save_state(writer);
+	OCPM::INTC::save_state(writer);
+	OCPM::Serial::save_state(writer);
+	OCPM::Timer::save_state(writer);
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (reader.begin_section("SH2 "))
+	{
+		reader.read(sh2.gpr);
+		reader.read(sh2.pc);
+		reader.read(sh2.pr);
+		reader.read(sh2.macl);
+		reader.read(sh2.mach);
+		reader.read(sh2.gbr);
+		reader.read(sh2.vbr);
+		reader.read(sh2.sr);
+		reader.read(sh2.pending_irq_prio);
+		reader.read(sh2.pending_irq_vector);
+		reader.end_section();
+	}
+
+	OCPM::load_state(reader);
+	OCPM::DMAC::load_state(reader);
+	OCPM::INTC::load_state(reader);
+	OCPM::Serial::load_state(reader);
+	OCPM::Timer::load_state(reader);
+}
+
 void run()
 {
-	while (sh2.cycles_left)
+	//A stall during an instruction can leave no cycles for the instruction itself to use
+	while (sh2.cycles_left > 0)
 	{
 		uint16_t instr = Bus::read16(sh2.pc - 4);
 		SH2::Interpreter::run(instr);
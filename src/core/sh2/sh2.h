@@ -1,5 +1,11 @@
 #pragma once
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace SH2
 {
 
@@ -7,4 +13,8 @@ void initialize();
 void shutdown();
 void run();
 
+//Includes the on-chip peripherals
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 }
\ No newline at end of file
@@ -12,7 +12,7 @@
 namespace SH2::Bus
 {
 
-static uint32_t translate_addr(uint32_t addr)
+uint32_t translate_addr(uint32_t addr)
 {
 	//Bits 28-31 are always ignored
 	//The on-chip region (bits 24-27 == 0xF) is NOT mirrored - all other regions are mirrored
@@ -27,6 +27,10 @@ static uint32_t translate_addr(uint32_t addr)
 #define MMIO_ACCESS(access, ...)											\
 	if (addr >= OCPM::ORAM_BASE_ADDR && addr < OCPM::ORAM_END_ADDR)			\
 		return OCPM::oram_##access(__VA_ARGS__);							\
+	if (addr >= Video::BITMAP_VRAM_START && addr < Video::TILE_VRAM_START)	\
+		return Video::bitmap_##access(__VA_ARGS__);							\
+	if (addr >= Video::TILE_VRAM_START && addr < Video::TILE_VRAM_END)		\
+		return Video::tile_##access(__VA_ARGS__);							\
 	if (addr >= Video::PALETTE_START && addr < Video::PALETTE_END)			\
 		return Video::palette_##access(__VA_ARGS__);						\
 	if (addr >= Video::OAM_START && addr < Video::OAM_END)					\
@@ -131,7 +135,7 @@ uint32_t read32(uint32_t addr)
 void write8(uint32_t addr, uint8_t value)
 {
 	addr = translate_addr(addr);
-	uint8_t* mem = sh2.pagetable[addr >> 12];
+	uint8_t* mem = sh2.write_pagetable[addr >> 12];
 	if (mem)
 	{
 		mem[addr & 0xFFF] = value;
@@ -144,7 +148,7 @@ void write8(uint32_t addr, uint8_t value)
 void write16(uint32_t addr, uint16_t value)
 {
 	addr = translate_addr(addr);
-	uint8_t* mem = sh2.pagetable[addr >> 12];
+	uint8_t* mem = sh2.write_pagetable[addr >> 12];
 	if (mem)
 	{
 		value = Common::bswp16(value);
@@ -157,7 +161,7 @@ void write16(uint32_t addr, uint16_t value)
 void write32(uint32_t addr, uint32_t value)
 {
 	addr = translate_addr(addr);
-	uint8_t* mem = sh2.pagetable[addr >> 12];
+	uint8_t* mem = sh2.write_pagetable[addr >> 12];
 	if (mem)
 	{
 		value = Common::bswp32(value);
@@ -4,6 +4,9 @@
 namespace SH2::Bus
 {
 
+//Strips the mirroring bits from an address
+uint32_t translate_addr(uint32_t addr);
+
 uint8_t read8(uint32_t addr);
 uint16_t read16(uint32_t addr);
 uint32_t read32(uint32_t addr);
@@ -19,6 +19,7 @@ struct CPU
 	int pending_irq_vector;
 
 	uint8_t** pagetable;
+	uint8_t** write_pagetable;
 };
 
 extern CPU sh2;
@@ -1,3 +1,6 @@
+#include <cstdio>
+#include <cstring>
+#include <common/state.h>
 #include <input/input.h>
 #include <sound/sound.h>
 #include <video/video.h>
@@ -6,14 +9,53 @@
 #include "core/cart.h"
 #include "core/loopy_io.h"
 #include "core/memory.h"
+#include "core/rewind.h"
 #include "core/system.h"
 #include "core/timing.h"
 
 namespace System
 {
 
+constexpr static char STATE_MAGIC[8] = { 'R', 'U', 'P', 'I', 'S', 'T', 'A', 'T' };
+
+//Must be increased whenever anything that goes into states changes
+constexpr static uint32_t STATE_VERSION = 1;
+
+static std::vector<uint8_t> backup_state;
+static std::vector<uint8_t> run_ahead_state;
+
+//Set if the machine couldn't be brought back from running ahead, which isn't tried again after that
+static bool run_ahead_failed;
+
+static bool read_state(const std::vector<uint8_t>& data)
+{
+	Common::StateReader reader(data.data(), data.size());
+
+	char magic[8];
+	reader.read_bytes(magic, 8);
+	uint32_t version = reader.read<uint32_t>();
+	if (!reader.good() || memcmp(magic, STATE_MAGIC, 8) || version != STATE_VERSION)
+	{
+		printf("[System] not a save state of this version\n");
+		return false;
+	}
+
+	//The scheduler goes first, other modules may depend on its time, and it validates the state's events
+	Timing::load_state(reader);
+	Memory::load_state(reader);
+	SH2::load_state(reader);
+	Cart::load_state(reader);
+	LoopyIO::load_state(reader);
+	Video::load_state(reader);
+	Sound::load_state(reader);
+
+	return reader.good();
+}
+
 void initialize(Config::SystemInfo& config)
 {
+	run_ahead_failed = false;
+
 	//Memory must initialize first
 	Memory::initialize(config.bios_rom);
 
@@ -29,16 +71,21 @@ void initialize(Config::SystemInfo& config)
 
 	//Initialize subprojects after everything else
 	Input::initialize();
-	Video::initialize();
-	Sound::initialize(config.sound_rom);
+	Video::initialize(config.video);
+	Sound::initialize(config.sound_rom, config.sound);
 
 	//Hook up connections between modules
 	SH2::OCPM::Serial::set_tx_callback(1, &Sound::midi_byte_in);
+
+	//Snapshots are of the whole machine, so rewinding starts once everything is set up
+	Rewind::initialize(config.rewind);
 }
 
 void shutdown()
 {
 	//Shutdown all components in the reverse order they were initialized
+	Rewind::shutdown();
+
 	Sound::shutdown();
 	Video::shutdown();
 	Input::shutdown();
@@ -52,10 +99,10 @@ void shutdown()
 	Memory::shutdown();
 }
 
-void run()
+static void run_frame(bool render)
 {
 	//Run an entire frame of emulation, stopping when the VDP reaches VSYNC
-	Video::start_frame();
+	Video::start_frame(render);
 
 	while (!Video::check_frame_end())
 	{
@@ -74,11 +121,80 @@ void run()
 			Timing::process_slice(i, slice_length);
 		}
 	}
+}
 
+void run(bool render)
+{
+	run_frame(render);
 	Cart::sram_commit_check();
 }
 
-uint16_t* get_display_output()
+void run_ahead(int frames)
+{
+	if (frames <= 0 || run_ahead_failed)
+	{
+		return;
+	}
+
+	//Sound is left out of the state, it can't affect the rest of the machine, and must only hear frames that really happen
+	Sound::set_suspended(true);
+	save_state(run_ahead_state);
+
+	for (int i = 0; i < frames; i++)
+	{
+		run_frame(i == frames - 1);
+	}
+
+	//The state was only just saved, so there is no need for a backup
+	//It can only fail to load if saving and loading disagree, which leaves the machine in the future it ran ahead to
+	if (!read_state(run_ahead_state))
+	{
+		printf("[System] failed to restore the state from before running ahead, run-ahead is disabled\n");
+		run_ahead_failed = true;
+	}
+	Sound::set_suspended(false);
+}
+
+void save_state(std::vector<uint8_t>& data)
+{
+	Common::StateWriter writer(data);
+	writer.write_bytes(STATE_MAGIC, 8);
+	writer.write(STATE_VERSION);
+
+	Timing::save_state(writer);
+	Memory::save_state(writer);
+	SH2::save_state(writer);
+	Cart::save_state(writer);
+	LoopyIO::save_state(writer);
+	Video::save_state(writer);
+	Sound::save_state(writer);
+}
+
+bool load_state(const std::vector<uint8_t>& data)
+{
+	//A state can turn out to be bad after part of it was loaded, so keep the current one to go back to
+	save_state(backup_state);
+	if (read_state(data))
+	{
+		return true;
+	}
+
+	printf("[System] failed to load state\n");
+
+	//The backup was only just saved, so this can only fail if saving and loading disagree
+	if (!read_state(backup_state))
+	{
+		printf("[System] failed to restore the previous state, the machine is only partly loaded\n");
+	}
+	return false;
+}
+
+bool display_changed()
+{
+	return Video::display_changed();
+}
+
+void* get_display_output()
 {
 	return Video::get_display_output();
 }
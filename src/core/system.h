@@ -1,4 +1,6 @@
 #pragma once
+#include <cstdint>
+#include <vector>
 #include "core/config.h"
 
 namespace System
@@ -7,8 +9,20 @@ namespace System
 void initialize(Config::SystemInfo& config);
 void shutdown();
 
-void run();
+//Runs an entire frame of emulation, without drawing it if render is false
+void run(bool render = true);
 
-uint16_t* get_display_output();
+//Run-ahead: runs this many frames past the current one and draws the last, then puts the machine back as it was
+//Input shows up that many frames sooner, as long as the game reacts to it within that many frames
+//Nothing of the frames ahead is heard or saved to SRAM, and only the display output is left changed
+void run_ahead(int frames);
+
+//Save states hold the whole machine as a flat binary, call these between frames on the emulation thread
+//A state that can't be loaded, e.g. from another game or version, leaves the machine as it was and returns false
+void save_state(std::vector<uint8_t>& data);
+bool load_state(const std::vector<uint8_t>& data);
+
+bool display_changed();
+void* get_display_output();
 
 }
\ No newline at end of file
@@ -1,22 +1,28 @@
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <vector>
+#include <common/state.h>
 #include "core/timing.h"
 
 namespace Timing
 {
 
+//Host events are numbered separately, so that the IDs of the events in states don't depend on them
+constexpr static int64_t HOST_EVENT_ID_BIT = 1ll << 62;
+
 struct RegisteredFunc
 {
 	std::string name;
 	EventFunc func;
+	bool host;
 };
 
 struct Event
 {
 	int64_t exec_time;
 	uint64_t param;
-	EventFunc func;
+	int func;
 	int64_t id;
 
 	friend bool operator>(const Event& l, const Event& r);
@@ -26,6 +32,8 @@ struct Timer
 {
 	int64_t timestamp;
 	int64_t next_event_id;
+	int64_t next_host_event_id;
+	int64_t stall_cycles;
 	int32_t slice_length;
 	int32_t* cycles_left;
 	std::vector<Event> events;
@@ -65,7 +73,13 @@ static State state;
 
 bool operator>(const Event& l, const Event& r)
 {
-	return l.exec_time > r.exec_time;
+	//Events at the same time run in the order they were added, whatever order the heap ends up in
+	if (l.exec_time != r.exec_time)
+	{
+		return l.exec_time > r.exec_time;
+	}
+
+	return l.id > r.id;
 }
 
 static Timer* get_timer(int id)
@@ -97,7 +111,7 @@ static void process_events()
 		timer->events.pop_back();
 
 		int cycles_late = timer->timestamp - ev.exec_time;
-		ev.func(ev.param, cycles_late);
+		state.funcs[ev.func].func(ev.param, cycles_late);
 	}
 }
 
@@ -137,9 +151,9 @@ void register_timer(TimerId id, int32_t* cycle_count, TimerFunc func)
 	state.timers[id].func = func;
 }
 
-FuncHandle register_func(std::string name, EventFunc func)
+FuncHandle register_func(std::string name, EventFunc func, bool host)
 {
-	RegisteredFunc reg = { name, func };
+	RegisteredFunc reg = { name, func, host };
 	state.funcs.push_back(reg);
 
 	FuncHandle handle;
@@ -154,12 +168,19 @@ EventHandle add_event(FuncHandle func, UnitCycle cycles, uint64_t param, int cor
 
 	Timer* timer = get_timer(core);
 
-	RegisteredFunc* reg_func = &state.funcs[func.value];
 	Event ev;
-	ev.func = reg_func->func;
+	ev.func = func.value;
 	ev.param = param;
-	ev.id = (timer->next_event_id << 8) | timer->id;
-	timer->next_event_id++;
+	if (state.funcs[func.value].host)
+	{
+		ev.id = HOST_EVENT_ID_BIT | (timer->next_host_event_id << 8) | timer->id;
+		timer->next_host_event_id++;
+	}
+	else
+	{
+		ev.id = (timer->next_event_id << 8) | timer->id;
+		timer->next_event_id++;
+	}
 
 	int64_t raw_cycles = (int64_t)cycles;
 	ev.exec_time = timer->get_timestamp() + raw_cycles;
@@ -204,10 +225,39 @@ void cancel_event(EventHandle& ev)
 	ev.value = -1;
 }
 
+void stall(UnitCycle cycles, int core)
+{
+	Timer* timer = get_timer(core);
+	timer->stall_cycles += (int64_t)cycles;
+
+	//Cut the running slice short, as the stalled time passes immediately
+	if (timer->in_slice)
+	{
+		int32_t cycles_left = timer->get_cycles_left();
+		int32_t stalled = (int32_t)std::min<int64_t>(timer->stall_cycles, cycles_left);
+		timer->set_cycles_left(cycles_left - stalled);
+		timer->stall_cycles -= stalled;
+	}
+}
+
 void process_slice(int id, int32_t slice)
 {
 	set_cur_timer(id, slice);
-	state.cur_timer->func();
+
+	//Stalls left over from previous slices use up this slice before the core gets to run
+	Timer* timer = state.cur_timer;
+	if (timer->stall_cycles)
+	{
+		int32_t stalled = (int32_t)std::min<int64_t>(timer->stall_cycles, slice);
+		timer->set_cycles_left(slice - stalled);
+		timer->stall_cycles -= stalled;
+	}
+
+	if (timer->get_cycles_left() > 0)
+	{
+		timer->func();
+	}
+
 	process_events();
 }
 
@@ -238,4 +288,126 @@ UnitCycle convert_cpu(int64_t cycles)
 	return convert<F_CPU>(cycles);
 }
 
+void save_state(Common::StateWriter& writer)
+{
+	writer.begin_section("TIME");
+
+	writer.write<uint32_t>(state.funcs.size());
+	for (auto& func : state.funcs)
+	{
+		writer.write<uint32_t>(func.name.size());
+		writer.write_bytes(func.name.data(), func.name.size());
+	}
+
+	for (auto& timer : state.timers)
+	{
+		assert(!timer.in_slice);
+		writer.write(timer.timestamp);
+		writer.write(timer.next_event_id);
+		writer.write(timer.stall_cycles);
+
+		uint32_t event_count = 0;
+		for (auto& ev : timer.events)
+		{
+			event_count += !state.funcs[ev.func].host;
+		}
+
+		writer.write(event_count);
+		for (auto& ev : timer.events)
+		{
+			if (!state.funcs[ev.func].host)
+			{
+				writer.write(ev.exec_time);
+				writer.write(ev.param);
+				writer.write<int32_t>(ev.func);
+				writer.write(ev.id);
+			}
+		}
+	}
+
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if (!reader.begin_section("TIME"))
+	{
+		return;
+	}
+
+	//Map the functions of the saved events to the ones registered now
+	uint32_t func_count = reader.read<uint32_t>();
+	std::vector<int> func_map;
+	for (uint32_t i = 0; i < func_count && reader.good(); i++)
+	{
+		uint32_t name_size = reader.read<uint32_t>();
+		if (name_size > 256)
+		{
+			reader.fail();
+			break;
+		}
+
+		std::string name(name_size, '\0');
+		reader.read_bytes(name.data(), name_size);
+
+		int index = -1;
+		for (int j = 0; j < (int)state.funcs.size(); j++)
+		{
+			if (state.funcs[j].name == name)
+			{
+				index = j;
+				break;
+			}
+		}
+
+		func_map.push_back(index);
+	}
+
+	std::vector<Timer> timers = state.timers;
+	for (auto& timer : timers)
+	{
+		timer.timestamp = reader.read<int64_t>();
+		timer.next_event_id = reader.read<int64_t>();
+		timer.stall_cycles = reader.read<int64_t>();
+
+		//Host events are dropped along with the rest
+		timer.events.clear();
+		uint32_t event_count = reader.read<uint32_t>();
+		for (uint32_t i = 0; i < event_count && reader.good(); i++)
+		{
+			Event ev;
+			ev.exec_time = reader.read<int64_t>();
+			ev.param = reader.read<uint64_t>();
+			int32_t func = reader.read<int32_t>();
+			ev.id = reader.read<int64_t>();
+
+			if (func < 0 || func >= (int)func_map.size() || func_map[func] < 0)
+			{
+				printf("[Timing] state has an event for an unknown function\n");
+				reader.fail();
+				break;
+			}
+
+			ev.func = func_map[func];
+			timer.events.push_back(ev);
+		}
+
+		std::make_heap(timer.events.begin(), timer.events.end(), std::greater<>());
+	}
+
+	if (!reader.end_section())
+	{
+		return;
+	}
+
+	//Timers are updated in place, as the current timer points to one of them
+	for (size_t i = 0; i < timers.size(); i++)
+	{
+		state.timers[i].timestamp = timers[i].timestamp;
+		state.timers[i].next_event_id = timers[i].next_event_id;
+		state.timers[i].stall_cycles = timers[i].stall_cycles;
+		state.timers[i].events = std::move(timers[i].events);
+	}
+}
+
 }
\ No newline at end of file
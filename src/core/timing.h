@@ -4,6 +4,12 @@
 #include <limits>
 #include <cstdint>
 
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
+
 namespace Timing
 {
 
@@ -55,16 +61,27 @@ void shutdown();
 
 void register_timer(TimerId id, int32_t* cycle_count, TimerFunc func);
 
-FuncHandle register_func(std::string name, EventFunc func);
+/* Host functions pace the frontend, e.g. audio output, instead of emulating hardware. Their events aren't
+ * saved in states, and all of them are dropped when a state is loaded, so their owners must schedule them again. */
+FuncHandle register_func(std::string name, EventFunc func, bool host = false);
 
 EventHandle add_event(FuncHandle func, UnitCycle cycles, uint64_t param = 0, int core = -1);
 void cancel_event(EventHandle& handle);
 
+/* Lets time pass on a core without running it, e.g. while the bus is held by another device.
+ * Whatever doesn't fit in the current slice is taken from the following slices. */
+void stall(UnitCycle cycles, int core = -1);
+
 void process_slice(int id, int32_t slice);
 int64_t calc_slice_length(int id);
 
 int64_t get_timestamp(int id = -1);
 
+/* Events refer to functions by name in states, so that they still load if registration order changes.
+ * Must be called between slices. */
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 UnitCycle convert_cpu(int64_t cycles);
 
 template <int FREQ> UnitCycle convert(int64_t num)
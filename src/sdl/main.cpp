@@ -1,11 +1,23 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <SDL.h>
 
 #include <common/bswp.h>
+#include <common/spsc_queue.h>
+#include <common/triple_buffer.h>
 #include <core/config.h>
+#include <core/rewind.h>
 #include <core/system.h>
 #include <input/input.h>
 #include <sound/sound.h>
@@ -26,16 +38,15 @@ struct Screen
 
 static Screen screen;
 
-void initialize()
+bool initialize()
 {
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
     {
         printf("Failed to initialize SDL2: %s\n", SDL_GetError());
-
-        exit(0);
+        return false;
     }
 
-    //Try synchronizing drawing to VBLANK
+    //Try synchronizing drawing to VBLANK, this only paces the presenter and not the emulator
     SDL_SetHint(SDL_HINT_RENDER_VSYNC, "1");
 
     //Set up SDL screen
@@ -45,7 +56,10 @@ void initialize()
     SDL_SetWindowResizable(screen.window, SDL_FALSE);
     SDL_RenderSetLogicalSize(screen.renderer, 2 * DISPLAY_WIDTH, 2 * DISPLAY_HEIGHT);
 
-    screen.texture = SDL_CreateTexture(screen.renderer, SDL_PIXELFORMAT_ARGB1555, SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    //Renderers don't generally support 16-bit textures natively, so SDL would convert every frame again
+    //The emulator draws in the texture's format instead
+    screen.texture = SDL_CreateTexture(screen.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    return true;
 }
 
 void shutdown() {
@@ -57,16 +71,269 @@ void shutdown() {
     SDL_Quit();
 }
 
-void update(uint16_t* display_output)
+void update(const void* frame, int pitch)
+{
+    SDL_UpdateTexture(screen.texture, NULL, frame, pitch);
+}
+
+void present()
 {
-    // Draw screen
-    SDL_UpdateTexture(screen.texture, NULL, display_output, sizeof(uint16_t) * DISPLAY_WIDTH);
+    // Draw screen, the texture still holds the last frame that was uploaded
     SDL_RenderCopy(screen.renderer, screen.texture, NULL, NULL);
     SDL_RenderPresent(screen.renderer);
 }
 
 }
 
+namespace EmuThread
+{
+
+//Copy of the display output in the display format
+typedef std::vector<uint8_t> Frame;
+
+static std::thread thread;
+static std::atomic<bool> running;
+
+//Events from the frontend are applied between frames, on the emulation thread
+static Common::SPSCQueue<std::function<void()>> commands(64);
+
+//Finished frames, only published when the display output changed
+static std::unique_ptr<Common::TripleBuffer<Frame>> frames;
+
+//Only touched by commands
+static bool rewinding;
+static bool fast_forwarding;
+
+//Frames that are run ahead of the machine to show, hiding that many frames of the game's input lag
+static int run_ahead_frames;
+
+void set_rewinding(bool enable)
+{
+    rewinding = enable;
+    Sound::set_rewinding(enable);
+
+    if (enable)
+    {
+        Rewind::Stats stats = Rewind::get_stats();
+        double seconds = (double)stats.frames * Video::CYCLES_PER_FRAME / Timing::F_CPU;
+        printf("Rewinding, %.1f seconds in %.1f MB\n", seconds, stats.bytes / (1024.0 * 1024.0));
+    }
+}
+
+void set_fast_forward(bool enable)
+{
+    fast_forwarding = enable;
+    Sound::set_fast_forward(enable);
+}
+
+void post(std::function<void()> command)
+{
+    while (!commands.push(command))
+    {
+        std::this_thread::yield();
+    }
+}
+
+static void run_commands()
+{
+    std::function<void()> command;
+    while (commands.pop(command))
+    {
+        command();
+    }
+}
+
+static void publish_frame()
+{
+    if (!System::display_changed())
+    {
+        return;
+    }
+
+    Frame& frame = frames->get_back();
+    memcpy(frame.data(), System::get_display_output(), frame.size());
+    frames->publish();
+}
+
+static void main_loop()
+{
+    using Clock = std::chrono::steady_clock;
+
+    //Without sound, emulation is paced by the host clock, so it runs at the right speed whatever the monitor's refresh rate is
+    constexpr static auto FRAME_DURATION = std::chrono::nanoseconds((int64_t)Video::CYCLES_PER_FRAME * 1000000000 / Timing::F_CPU);
+
+    //If the host falls further behind than this, stop trying to catch up
+    constexpr static int MAX_FRAMES_BEHIND = 3;
+
+    auto next_frame = Clock::now();
+
+    //While fast-forwarding, frames are only drawn as often as they would be at normal speed, as no more can be shown
+    auto next_drawn_frame = next_frame;
+
+    while (running)
+    {
+        run_commands();
+
+        //Set when no emulated time passes this frame, so the audio device can't set the pace
+        bool holding = false;
+        if (rewinding)
+        {
+            //Go back a snapshot each frame, running a frame from it to have something to show
+            //Once there are none left, the last frame stays on screen instead of playing on
+            if (Rewind::step_back())
+            {
+                System::run();
+            }
+            else
+            {
+                holding = true;
+            }
+        }
+        else if (fast_forwarding)
+        {
+            auto now = Clock::now();
+            bool render = now >= next_drawn_frame;
+            if (render)
+            {
+                next_drawn_frame = now + FRAME_DURATION;
+            }
+
+            System::run(render);
+            Rewind::frame_end();
+            publish_frame();
+
+            //Nothing holds the emulator back, it runs as fast as the host allows
+            next_frame = Clock::now();
+            continue;
+        }
+        else
+        {
+            //With run-ahead, the frame that really happens is heard but not shown
+            System::run(!run_ahead_frames);
+            Rewind::frame_end();
+            System::run_ahead(run_ahead_frames);
+        }
+        publish_frame();
+
+        //While sound is playing, the audio device sets the pace so that it never runs dry or falls behind
+        if (!holding && Sound::wait_for_audio())
+        {
+            next_frame = Clock::now();
+            continue;
+        }
+
+        next_frame += FRAME_DURATION;
+        auto now = Clock::now();
+        if (now - next_frame > FRAME_DURATION * MAX_FRAMES_BEHIND)
+        {
+            next_frame = now;
+        }
+
+        std::this_thread::sleep_until(next_frame);
+    }
+}
+
+void start(int frame_size, int run_ahead)
+{
+    frames = std::make_unique<Common::TripleBuffer<Frame>>(Frame(frame_size));
+    running = true;
+    rewinding = false;
+    fast_forwarding = false;
+    run_ahead_frames = run_ahead;
+    thread = std::thread(main_loop);
+}
+
+void stop()
+{
+    running = false;
+    thread.join();
+}
+
+//Returns the newest frame if one was published since the last call, or null otherwise
+const Frame* get_new_frame()
+{
+    if (!frames->update())
+    {
+        return nullptr;
+    }
+
+    return &frames->get_front();
+}
+
+}
+
+//Prints what the audio pipeline did since the last stats were taken, durations in ms unless noted otherwise
+static void log_audio_stats(const Sound::AudioStats& stats)
+{
+    if (!stats.callback_time_us.count)
+    {
+        return;
+    }
+
+    double ms_per_sample = 1000.0 / stats.sample_rate;
+    printf("[Sound] Callbacks %llu: time %.0f/%u us (mean/p99), ahead %.1f/%.1f (mean/p1), underruns %llu, rate %.4f\n",
+        (unsigned long long)stats.callback_time_us.count,
+        stats.callback_time_us.mean(), stats.callback_time_us.percentile(0.99),
+        stats.buffered_samples.mean() * ms_per_sample, stats.buffered_samples.percentile(0.01) * ms_per_sample,
+        (unsigned long long)stats.underruns, stats.rate_ratio);
+    printf("[Sound] MIDI: queue %.1f/%u (mean/p99), late %.2f/%.2f (mean/p99), overflows %llu, time corrections %llu\n",
+        stats.midi_queue_depth.mean(), stats.midi_queue_depth.percentile(0.99),
+        stats.midi_lateness.mean() * ms_per_sample, stats.midi_lateness.percentile(0.99) * ms_per_sample,
+        (unsigned long long)stats.midi_overflows, (unsigned long long)stats.time_corrections.count);
+}
+
+//Run on the emulation thread, between frames
+static void save_state_file(const std::string& path)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> data;
+    System::save_state(data);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+    std::ofstream file(path, std::ios::binary);
+    file.write((char*)data.data(), data.size());
+    if (!file)
+    {
+        printf("Failed to write %s\n", path.c_str());
+        return;
+    }
+
+    printf("Saved state to %s (%zu bytes in %lld us)\n", path.c_str(), data.size(), (long long)elapsed.count());
+}
+
+static void load_state_file(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        printf("Failed to open %s\n", path.c_str());
+        return;
+    }
+
+    std::vector<uint8_t> data(std::istreambuf_iterator<char>(file), {});
+    if (System::load_state(data))
+    {
+        printf("Loaded state from %s\n", path.c_str());
+    }
+}
+
+//Records sound without a display or audio device, as fast as the host can emulate
+static void run_offline(double seconds)
+{
+    //Nothing is shown, so no frames are drawn either
+    Video::set_render_mode(Video::RenderMode::None);
+
+    int frames = (int)(seconds * Timing::F_CPU / Video::CYCLES_PER_FRAME);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++)
+    {
+        System::run();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    printf("Rendered %.1f seconds of sound in %.1f seconds\n", seconds, elapsed.count() / 1000.0);
+}
+
 std::string remove_extension(std::string file_path)
 {
     auto pos = file_path.find(".");
@@ -80,19 +347,142 @@ std::string remove_extension(std::string file_path)
 
 int main(int argc, char** argv)
 {
-    if (argc < 3)
+    Config::SystemInfo config = {};
+
+    //Only worth rendering on another thread if there's a spare core for it
+    config.video.threaded_render = std::thread::hardware_concurrency() > 1;
+
+    //Rendering mode used while the window is visible
+    Video::RenderMode render_mode = Video::RenderMode::Full;
+    int frame_skip = 0;
+
+    //Seconds between audio stats printouts, or 0 to not print them
+    int audio_stats_interval = 0;
+
+    int run_ahead = 0;
+
+    //Emulated seconds to record when rendering sound offline
+    double wav_length = 60.0;
+
+    //Options can appear anywhere, everything else is a file name
+    std::vector<std::string> file_args;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+        {
+            file_args.push_back(arg);
+            continue;
+        }
+
+        if (arg == "--no-render-thread")
+        {
+            config.video.threaded_render = false;
+        }
+        else if (arg == "--lockstep-audio")
+        {
+            config.sound.lockstep = true;
+        }
+        else if (arg == "--wav" && i + 1 < argc)
+        {
+            config.sound.offline = true;
+            config.sound.wav_file_path = argv[++i];
+        }
+        else if (arg == "--length" && i + 1 < argc)
+        {
+            wav_length = std::max(atof(argv[++i]), 0.0);
+        }
+        else if (arg == "--sample-rate" && i + 1 < argc)
+        {
+            config.sound.sample_rate = std::max(atoi(argv[++i]), 8000);
+        }
+        else if (arg == "--buffer-size" && i + 1 < argc)
+        {
+            config.sound.buffer_size = std::clamp(atoi(argv[++i]), 64, 16384);
+        }
+        else if (arg == "--timeref" && i + 1 < argc)
+        {
+            config.sound.timeref_frequency = std::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "--mix-level" && i + 1 < argc)
+        {
+            config.sound.mix_level = std::max((float)atof(argv[++i]), 0.f);
+        }
+        else if (arg == "--no-sound-filter")
+        {
+            config.sound.filter_enable = false;
+        }
+        else if (arg == "--mute-fade" && i + 1 < argc)
+        {
+            config.sound.mute_fade_ms = std::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "--audio-stats" && i + 1 < argc)
+        {
+            audio_stats_interval = std::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "--rewind" && i + 1 < argc)
+        {
+            config.rewind.buffer_size = (size_t)std::max(atoi(argv[++i]), 0) * 1024 * 1024;
+        }
+        else if (arg == "--rewind-interval" && i + 1 < argc)
+        {
+            config.rewind.interval = std::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "--run-ahead" && i + 1 < argc)
+        {
+            run_ahead = std::clamp(atoi(argv[++i]), 0, 8);
+        }
+        else if (arg == "--frame-skip" && i + 1 < argc)
+        {
+            frame_skip = std::max(atoi(argv[++i]), 0);
+            render_mode = frame_skip ? Video::RenderMode::Skip : Video::RenderMode::Full;
+        }
+        else
+        {
+            printf("Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (file_args.size() < 2)
     {
         //Sound ROM currently optional
-        printf("Args: <game ROM> <BIOS> [sound BIOS]\n");
+        printf("Args: [options] <game ROM> <BIOS> [sound BIOS]\n");
+        printf("Options:\n");
+        printf("  --no-render-thread  Draw scanlines on the emulation thread\n");
+        printf("  --frame-skip <n>    Only draw one out of every n+1 frames\n");
+        printf("  --run-ahead <n>     Show frames n ahead to hide input lag, costs n extra frames of emulation each frame\n");
+        printf("  --lockstep-audio    Synthesize sound on the emulation thread for exact MIDI timing\n");
+        printf("  --wav <file>        Record sound to a WAV file without a window, as fast as possible\n");
+        printf("  --length <s>        Seconds of sound to record with --wav (default %.0f)\n", wav_length);
+        printf("  --sample-rate <hz>  Audio output sample rate (default %d)\n", config.sound.sample_rate);
+        printf("  --buffer-size <n>   Audio device buffer size in samples (default %d), F9/F10 change it while running\n", config.sound.buffer_size);
+        printf("  --timeref <hz>      Audio time reference frequency, 0 to disable (default %d)\n", config.sound.timeref_frequency);
+        printf("  --mix-level <x>     Final audio mix level (default %.2f)\n", config.sound.mix_level);
+        printf("  --no-sound-filter   Disable the audio output filters\n");
+        printf("  --mute-fade <ms>    Fade time when sound is muted (default %d)\n", config.sound.mute_fade_ms);
+        printf("  --audio-stats <s>   Print audio timing statistics every s seconds\n");
+        printf("  --rewind <mb>       Keep snapshots in this much memory to rewind with Backspace\n");
+        printf("  --rewind-interval <n> Frames between rewind snapshots (default %d)\n", config.rewind.interval);
+        printf("F5 saves the machine state next to the game ROM, F8 loads it\n");
+        printf("Tab fast-forwards while held\n");
         return 1;
     }
 
-    SDL::initialize();
+    //Offline rendering is headless, so it also works without a display
+    if (config.sound.offline && file_args.size() < 3)
+    {
+        printf("Recording sound needs the sound BIOS\n");
+        return 1;
+    }
 
-    std::string cart_name = argv[1];
-    std::string bios_name = argv[2];
+    if (!config.sound.offline && !SDL::initialize())
+    {
+        return 1;
+    }
 
-    Config::SystemInfo config = {};
+    std::string cart_name = file_args[0];
+    std::string bios_name = file_args[1];
 
     std::ifstream cart_file(cart_name, std::ios::binary);
     if (!cart_file.is_open())
@@ -115,9 +505,9 @@ int main(int argc, char** argv)
     bios_file.close();
 
     // If last argument is given, load the sound ROM
-    if (argc >= 4)
+    if (file_args.size() >= 3)
     {
-        std::string sound_rom_name = argv[3];
+        std::string sound_rom_name = file_args[2];
         std::ifstream sound_rom_file(sound_rom_name, std::ios::binary);
         if (!sound_rom_file.is_open())
         {
@@ -156,6 +546,16 @@ int main(int argc, char** argv)
 
     //Initialize the emulator and all of its subprojects
     System::initialize(config);
+    if (config.sound.offline)
+    {
+        run_offline(wav_length);
+        System::shutdown();
+        return 0;
+    }
+
+    Video::set_render_mode(render_mode, frame_skip);
+    Video::set_display_output(Video::DisplayFormat::ARGB8888);
+    int display_pitch = Video::get_display_pitch();
 
     //All subprojects have been initialized, so it is safe to reference them now
     Input::add_key_binding(SDLK_RETURN, Input::PAD_START);
@@ -173,12 +573,22 @@ int main(int argc, char** argv)
     Input::add_key_binding(SDLK_UP, Input::PAD_UP);
     Input::add_key_binding(SDLK_DOWN, Input::PAD_DOWN);
     
+    //The emulator runs on its own thread, while this one handles events and presents the newest frame
+    //SDL needs both of these on the thread that created the window
+    EmuThread::start(display_pitch * Video::DISPLAY_HEIGHT, run_ahead);
+
+    //The frontend's copy of the sound parameters, changes are applied on the emulation thread
+    Config::SoundInfo sound_config = config.sound;
+
+    //F5 saves the whole machine next to the game, F8 loads it back
+    std::string state_path = remove_extension(cart_name) + ".state";
+
+    Sound::AudioStats last_audio_stats = Sound::get_audio_stats();
+    uint32_t last_audio_stats_ticks = SDL_GetTicks();
+
     bool has_quit = false;
     while (!has_quit)
     {
-        System::run();
-        SDL::update(System::get_display_output());
-
         SDL_Event e;
         while (SDL_PollEvent(&e))
         {
@@ -188,29 +598,107 @@ int main(int argc, char** argv)
                 has_quit = true;
                 break;
             case SDL_KEYDOWN:
-                Input::set_key_state(e.key.keysym.sym, true);
-                break;
             case SDL_KEYUP:
-                Input::set_key_state(e.key.keysym.sym, false);
+            {
+                int key = e.key.keysym.sym;
+
+                //Halve or double the audio buffer, to find the smallest one that plays without underruns
+                if ((key == SDLK_F9 || key == SDLK_F10) && e.type == SDL_KEYDOWN)
+                {
+                    int size = (key == SDLK_F9) ? sound_config.buffer_size / 2 : sound_config.buffer_size * 2;
+                    sound_config.buffer_size = std::clamp(size, 64, 16384);
+                    printf("Audio buffer size %d\n", sound_config.buffer_size);
+                    EmuThread::post([=]() mutable { Sound::reconfigure(sound_config); });
+                    break;
+                }
+
+                if (key == SDLK_F5 && e.type == SDL_KEYDOWN)
+                {
+                    EmuThread::post([=] { save_state_file(state_path); });
+                    break;
+                }
+
+                if (key == SDLK_F8 && e.type == SDL_KEYDOWN)
+                {
+                    EmuThread::post([=] { load_state_file(state_path); });
+                    break;
+                }
+
+                //Runs as fast as possible for as long as the key is held
+                if (key == SDLK_TAB)
+                {
+                    if (!e.key.repeat)
+                    {
+                        bool pressed = e.type == SDL_KEYDOWN;
+                        EmuThread::post([=] { EmuThread::set_fast_forward(pressed); });
+                    }
+                    break;
+                }
+
+                //Rewinds for as long as the key is held
+                if (key == SDLK_BACKSPACE && Rewind::is_enabled())
+                {
+                    if (!e.key.repeat)
+                    {
+                        bool pressed = e.type == SDL_KEYDOWN;
+                        EmuThread::post([=] { EmuThread::set_rewinding(pressed); });
+                    }
+                    break;
+                }
+
+                bool pressed = e.type == SDL_KEYDOWN;
+                EmuThread::post([=] { Input::set_key_state(key, pressed); });
                 break;
+            }
             case SDL_WINDOWEVENT:
-                // Everything slows down when minimized so mute sound
+                // Mute sound while the window can't be seen
+                // Nothing is visible either, so there's no point in drawing frames
                 switch (e.window.event)
                 {
                 case SDL_WINDOWEVENT_HIDDEN:
                 case SDL_WINDOWEVENT_MINIMIZED:
-                    Sound::set_mute(true);
+                    EmuThread::post([] {
+                        Sound::set_mute(true);
+                        Video::set_render_mode(Video::RenderMode::None);
+                    });
                     break;
                 case SDL_WINDOWEVENT_SHOWN:
                 case SDL_WINDOWEVENT_MAXIMIZED:
                 case SDL_WINDOWEVENT_RESTORED:
-                    Sound::set_mute(false);
+                    EmuThread::post([=] {
+                        Sound::set_mute(false);
+                        Video::set_render_mode(render_mode, frame_skip);
+                    });
+                    break;
+                case SDL_WINDOWEVENT_EXPOSED:
+                    SDL::present();
                     break;
                 }
             }
         }
+
+        //Presenting blocks until VBLANK when vsync is available, otherwise just wait a little for the next frame
+        const EmuThread::Frame* frame = EmuThread::get_new_frame();
+        if (frame)
+        {
+            SDL::update(frame->data(), display_pitch);
+            SDL::present();
+        }
+        else
+        {
+            SDL_Delay(1);
+        }
+
+        if (audio_stats_interval && SDL_GetTicks() - last_audio_stats_ticks >= (uint32_t)audio_stats_interval * 1000)
+        {
+            Sound::AudioStats audio_stats = Sound::get_audio_stats();
+            log_audio_stats(audio_stats - last_audio_stats);
+            last_audio_stats = audio_stats;
+            last_audio_stats_ticks = SDL_GetTicks();
+        }
     }
-    
+
+    EmuThread::stop();
     System::shutdown();
     SDL::shutdown();
 
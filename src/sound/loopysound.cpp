@@ -19,14 +19,134 @@ Game support notes:
 #include <cmath>
 #include <cstring>
 #include <cstdio>
+#include <map>
 #include <memory>
 #include <vector>
-
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include <common/state.h>
 #include <sound/loopysound.h>
 
 namespace LoopySound
 {
 
+// Interpolate, scale and accumulate one voice over a segment
+static void mix_voice_scalar(int accum[], const UPD937_MixBuffer& mb, int start, int frames, int slider_level)
+{
+	for(int i = start; i < frames; i++)
+	{
+		int s = mb.last_val[i];
+		int sb = mb.next_val[i];
+		int sd = ((sb - s) * mb.fract[i]) / 0x8000;
+		s += sd;
+		s = (s * mb.volume[i]) / 65536;
+		s = (s * slider_level) / 4096;
+		accum[i] += s;
+	}
+}
+
+#if defined(__AVX2__)
+// Signed division by 2^SHIFT rounding toward zero, same as the scalar divides
+template <int SHIFT>
+static inline __m256i div_pow2(__m256i x)
+{
+	__m256i bias = _mm256_and_si256(_mm256_srai_epi32(x, 31), _mm256_set1_epi32((1 << SHIFT) - 1));
+	return _mm256_srai_epi32(_mm256_add_epi32(x, bias), SHIFT);
+}
+
+static int mix_voice_simd(int accum[], const UPD937_MixBuffer& mb, int frames, int slider_level)
+{
+	__m256i slider = _mm256_set1_epi32(slider_level);
+	int i = 0;
+	for(; i + 8 <= frames; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)&mb.last_val[i]);
+		__m256i sb = _mm256_loadu_si256((const __m256i*)&mb.next_val[i]);
+		__m256i fract = _mm256_loadu_si256((const __m256i*)&mb.fract[i]);
+		__m256i volume = _mm256_loadu_si256((const __m256i*)&mb.volume[i]);
+		s = _mm256_add_epi32(s, div_pow2<15>(_mm256_mullo_epi32(_mm256_sub_epi32(sb, s), fract)));
+		s = div_pow2<16>(_mm256_mullo_epi32(s, volume));
+		s = div_pow2<12>(_mm256_mullo_epi32(s, slider));
+		__m256i a = _mm256_loadu_si256((const __m256i*)&accum[i]);
+		_mm256_storeu_si256((__m256i*)&accum[i], _mm256_add_epi32(a, s));
+	}
+	return i;
+}
+#elif defined(__SSE2__)
+// Signed division by 2^SHIFT rounding toward zero, same as the scalar divides
+template <int SHIFT>
+static inline __m128i div_pow2(__m128i x)
+{
+	__m128i bias = _mm_and_si128(_mm_srai_epi32(x, 31), _mm_set1_epi32((1 << SHIFT) - 1));
+	return _mm_srai_epi32(_mm_add_epi32(x, bias), SHIFT);
+}
+
+// Low 32 bits of a 32x32 multiply, which SSE2 only has for every other lane
+static inline __m128i mullo_epi32(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static int mix_voice_simd(int accum[], const UPD937_MixBuffer& mb, int frames, int slider_level)
+{
+	__m128i slider = _mm_set1_epi32(slider_level);
+	int i = 0;
+	for(; i + 4 <= frames; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)&mb.last_val[i]);
+		__m128i sb = _mm_loadu_si128((const __m128i*)&mb.next_val[i]);
+		__m128i fract = _mm_loadu_si128((const __m128i*)&mb.fract[i]);
+		__m128i volume = _mm_loadu_si128((const __m128i*)&mb.volume[i]);
+		s = _mm_add_epi32(s, div_pow2<15>(mullo_epi32(_mm_sub_epi32(sb, s), fract)));
+		s = div_pow2<16>(mullo_epi32(s, volume));
+		s = div_pow2<12>(mullo_epi32(s, slider));
+		__m128i a = _mm_loadu_si128((const __m128i*)&accum[i]);
+		_mm_storeu_si128((__m128i*)&accum[i], _mm_add_epi32(a, s));
+	}
+	return i;
+}
+#else
+static int mix_voice_simd(int accum[], const UPD937_MixBuffer& mb, int frames, int slider_level)
+{
+	return 0;
+}
+#endif
+
+static void mix_voice(int accum[], const UPD937_MixBuffer& mb, int frames, int slider_level)
+{
+	int done = SIMD_MIX_ENABLE ? mix_voice_simd(accum, mb, frames, slider_level) : 0;
+	mix_voice_scalar(accum, mb, done, frames, slider_level);
+}
+
+// Index of the lowest set bit, mask must not be zero
+static inline int lowest_set_bit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Step a volume ramp counter over frames samples in one go
+static void skip_ramp_counter(UPD937_VoiceState *vo, uint32_t frames)
+{
+	uint32_t first_wrap = std::max(vo->volume_rate_div - vo->volume_rate_counter, 1);
+	if(frames >= first_wrap) vo->volume_rate_counter = (frames - first_wrap) % std::max(vo->volume_rate_div, 1);
+	else vo->volume_rate_counter += frames;
+}
+
 UPD937_Core::UPD937_Core(std::vector<uint8_t>& rom_in, float synthesis_rate)
 {
 	// Pad ROM to a power of 2
@@ -42,12 +162,17 @@ UPD937_Core::UPD937_Core(std::vector<uint8_t>& rom_in, float synthesis_rate)
 	ptr_volenv   = read_rom_16(4) * 32;
 	ptr_sampdesc = read_rom_16(6) * 32;
 	ptr_demosong = read_rom_16(8) * 32;
+	decode_rom_tables();
+	decode_instruments();
 
 	// Setup voice state
+	// They all start out idle, as of the first sample
 	for(int v = 0; v < 32; v++)
 	{
 		voices[v] = {};
+		voice_idle_since[v] = 0;
 	}
+	active_voices = 0;
 
 	// Setup channel state
 	for(int c = 0; c < 4; c++)
@@ -66,31 +191,131 @@ UPD937_Core::UPD937_Core(std::vector<uint8_t>& rom_in, float synthesis_rate)
 	volume_slider[0] = volume_slider[1] = 4;
 }
 
-void UPD937_Core::gen_sample(int out[])
+void UPD937_Core::render_block(int out[], int frames)
 {
-	update_sample();
-	for(int lr = 0; lr <= 1; lr++)
+	// Output is interleaved stereo
+	int clk2_div = (int) round(CLK2_DIVP * synthesis_rate);
+	int done = 0;
+	while(done < frames)
+	{
+		// Clock the volume & pitch envelope generators
+		// They only ever fire on the first sample of a segment, so voices run without checks in between
+		if((sample_count%384) == 0) update_volume_envelopes();
+		clk2_counter += CLK2_MUL;
+		if(clk2_counter >= clk2_div)
+		{
+			update_pitch_envelopes();
+			clk2_counter -= clk2_div;
+		}
+
+		// Run until the next envelope clock
+		int n = std::min(frames - done, SYNTH_SEGMENT_SIZE);
+		n = std::min(n, 384 - (int)(sample_count%384));
+		n = std::min(n, (clk2_div - clk2_counter + CLK2_MUL - 1) / CLK2_MUL);
+		clk2_counter += (n-1) * CLK2_MUL;
+
+		render_segment(out + done*2, n);
+		sample_count += n;
+		done += n;
+	}
+}
+
+void UPD937_Core::render_segment(int out[], int frames)
+{
+	int accum[2][SYNTH_SEGMENT_SIZE] = {};
+	for(uint32_t mask = active_voices; mask; mask &= mask-1)
 	{
-		int accum = 0;
-		for(int v = 0; v < 32; v += 2)
+		int v = lowest_set_bit(mask);
+		UPD937_VoiceState *vo = &voices[v];
+		UPD937_ChannelState *ch = &channels[vo->channel];
+		if(is_voice_silent(vo))
 		{
-			UPD937_VoiceState *vo = &voices[v+lr];
-			UPD937_ChannelState *ch = &channels[vo->channel];
-			if(vo->volume == 0 || ch->mute) continue;
-			int s = vo->sample_last_val;
-			int sb = (read_rom_16(vo->sample_ptr*2)>>4) - 0x800;
-			int sd = ((sb - s) * vo->sample_fract) / 0x8000;
-			s += sd;
-			s = (s * vo->volume) / 65536;
-			if(vo->channel > 0)
+			if(vo->volume_env_delay <= 0)
 			{
-				s = (s * VOLUME_SLIDER_LEVELS[volume_slider[vo->channel==3 ? 1 : 0]]) / 4096;
+				// Neither envelope can bring it back, only a new note or program change will
+				active_voices &= ~(1u << v);
+				voice_idle_since[v] = sample_count;
+				continue;
 			}
-			accum += s;
+
+			// Only the ramp counter moves, wrap it forward in one go
+			skip_ramp_counter(vo, frames);
+			continue;
 		}
-		accum = std::clamp(accum, -32767, 32767);
-		out[lr] = accum;
+
+		// Pitch and mix level only change on envelope clocks and MIDI events, neither happens within a segment
+		int pitch_relative = vo->pitch;
+		pitch_relative += vo->pitch_env_value/16;
+		pitch_relative += ch->bend_offset;
+		//if(pitch_relative < 0) pitch_relative = 0;
+		//if(pitch_relative > 0x5FF) pitch_relative = 0x5FF;
+		int pitch_step = read_pitch_table(pitch_relative);
+		// Channel 0 isn't affected by the sliders, full level leaves its samples unchanged
+		int slider_level = (vo->channel > 0) ? VOLUME_SLIDER_LEVELS[volume_slider[vo->channel==3 ? 1 : 0]] : 4096;
+		int next_val = read_pcm(vo->sample_ptr);
+
+		// Step the voice and record what the mixer needs for each sample
+		for(int i = 0; i < frames; i++)
+		{
+			// Update volume/pitch ramps
+			vo->volume_rate_counter++;
+			if(vo->volume_rate_counter >= vo->volume_rate_div)
+			{
+				vo->volume_rate_counter = 0;
+				if(vo->volume_down)
+				{
+					vo->volume = std::clamp(std::max(vo->volume_target, vo->volume - vo->volume_rate_mul), 0, 65535);
+				}
+				else
+				{
+					vo->volume = std::clamp(std::min(vo->volume_target, vo->volume + vo->volume_rate_mul), 0, 65535);
+				}
+			}
+			if(vo->volume > 0)
+			{
+				int last_ptr = vo->sample_ptr;
+				vo->sample_fract += pitch_step;
+				if(vo->sample_fract >= 0x8000)
+				{
+					vo->sample_fract -= 0x8000;
+					vo->sample_last_val = next_val;
+					vo->sample_ptr++;
+				}
+				if(vo->sample_ptr > vo->sample_end) vo->sample_ptr = vo->sample_loop;
+				if(vo->sample_ptr != last_ptr) next_val = read_pcm(vo->sample_ptr);
+			}
+			// Zero volume mixes to exactly zero
+			mix_buffer.last_val[i] = vo->sample_last_val;
+			mix_buffer.next_val[i] = next_val;
+			mix_buffer.fract[i] = vo->sample_fract;
+			mix_buffer.volume[i] = vo->volume;
+		}
+
+		// Mix, even voices go left and odd voices go right
+		if(!ch->mute) mix_voice(accum[v & 1], mix_buffer, frames, slider_level);
 	}
+
+	for(int i = 0; i < frames; i++)
+	{
+		out[i*2+0] = std::clamp(accum[0][i], -32767, 32767);
+		out[i*2+1] = std::clamp(accum[1][i], -32767, 32767);
+	}
+}
+
+void UPD937_Core::wake_voice(int v)
+{
+	if(active_voices & (1u << v)) return;
+	// Catch up on the ramp counter, it kept running while the voice was idle
+	skip_ramp_counter(&voices[v], sample_count - voice_idle_since[v]);
+	active_voices |= 1u << v;
+}
+
+bool UPD937_Core::is_voice_silent(UPD937_VoiceState *vo)
+{
+	// A voice at zero volume stays there if its ramp can't take it above zero
+	if(vo->volume != 0) return false;
+	if(vo->volume_down) return vo->volume_target <= 0 && vo->volume_rate_mul >= 0;
+	return vo->volume_target <= 0 || vo->volume_rate_mul <= 0;
 }
 
 void UPD937_Core::set_channel_configuration(bool multi, bool all)
@@ -157,7 +382,7 @@ void UPD937_Core::reset_channels(bool clear_program)
 void UPD937_Core::process_midi_now(char midi_byte)
 {
 	// This function must be called from the audio thread!
-	// TODO: make thread safe?
+	// Bytes from the emulator arrive through LoopySound's MIDI queue
 	int m = midi_byte & 0xFF;
 	if(m >= 0x80)
 	{
@@ -251,63 +476,169 @@ int UPD937_Core::read_rom_24(int offset)
 	return ((rom[(offset+2)&rom_mask]&0xFF)<<16)|((rom[(offset+1)&rom_mask]&0xFF)<<8)|(rom[offset&rom_mask]&0xFF);
 }
 
-void UPD937_Core::update_sample()
+int UPD937_Core::read_pcm(int sample_ptr)
 {
-	// Clock the volume & pitch envelope generators
-	if((sample_count%384) == 0) update_volume_envelopes();
-	int clk2_div = (int) round(CLK2_DIVP * synthesis_rate);
-	clk2_counter += CLK2_MUL;
-	if(clk2_counter >= clk2_div)
+	// Sample pointers come from the ROM and may point past its end, so they wrap like ROM reads do
+	return pcm[sample_ptr&pcm_mask];
+}
+
+int UPD937_Core::read_pitch_table(int index)
+{
+	// Pitch can be bent or enveloped off either end of the table, where the ROM data around it is used
+	if(index >= 0 && index < HC_PITCHTABLE_SIZE) return pitch_table[index];
+	return read_rom_16(ptr_pitchtable + index*2);
+}
+
+void UPD937_Core::decode_rom_tables()
+{
+	int pcm_size = std::max((rom_mask+1)/2, 1);
+	pcm = std::make_unique<int16_t[]>(pcm_size);
+	pcm_mask = pcm_size-1;
+	for(int i = 0; i < pcm_size; i++)
 	{
-		update_pitch_envelopes();
-		clk2_counter -= clk2_div;
+		pcm[i] = (read_rom_16(i*2)>>4) - 0x800;
 	}
 
-	// Update volume/pitch ramps
-	for(int v = 0; v < 32; v++)
+	for(int i = 0; i < HC_RATETABLE_SIZE; i++)
 	{
-		UPD937_VoiceState *vo = &voices[v];
-		vo->volume_rate_counter++;
-		if(vo->volume_rate_counter >= vo->volume_rate_div)
+		rate_table_mul[i] = read_rom_16(ptr_ratetable + i*4 + 0);
+		rate_table_div[i] = read_rom_8(ptr_ratetable + i*4 + 2);
+		rate_table_bend[i] = read_rom_8(ptr_ratetable + i*4 + 3);
+	}
+	for(int i = 0; i < HC_VOLTABLE_SIZE; i++)
+	{
+		volume_table[i] = read_rom_16(ptr_voltable + i*2);
+	}
+	for(int i = 0; i < HC_PITCHTABLE_SIZE; i++)
+	{
+		pitch_table[i] = read_rom_16(ptr_pitchtable + i*2);
+	}
+}
+
+void UPD937_Core::decode_instruments()
+{
+	// Envelopes and groups of partials are shared between instruments, only decode each one once
+	std::map<int, int> volume_envelope_index, pitch_envelope_index;
+	std::map<std::pair<int, bool>, int> partial_group_index;
+	partials.clear();
+	volume_envelopes.clear();
+	pitch_envelopes.clear();
+
+	for(int i = 0; i < HC_NUM_INSTRUMENTS; i++)
+	{
+		UPD937_Instrument *inst = &instruments[i];
+		int partials_offset = read_rom_16(ptr_instdesc + i*4 + 0);
+		int keymap_no = read_rom_8(ptr_instdesc + i*4 + 2);
+		int flags = read_rom_8(ptr_instdesc + i*4 + 3);
+		inst->layered = (flags & 0x10) > 0;
+		int voices_per_note = inst->layered ? 4 : 2;
+
+		for(int n = 0; n < 61; n++)
 		{
-			vo->volume_rate_counter = 0;
-			if(vo->volume_down)
+			// Get keymap and partial address
+			int keymap_val = (read_rom_8(ptr_keymaps + keymap_no*32 + n/2) >> ((n&1)*4)) & 0xF;
+			int partial_addr = (partials_offset + keymap_val * voices_per_note * 3) * 2;
+			// TODO: From here layering needs to be implemented with allocating extra voices
+
+			auto group = partial_group_index.find({partial_addr, inst->layered});
+			if(group != partial_group_index.end())
 			{
-				vo->volume = std::clamp(std::max(vo->volume_target, vo->volume - vo->volume_rate_mul), 0, 65535);
+				inst->note_partials[n] = group->second;
+				continue;
 			}
-			else
+			inst->note_partials[n] = partial_group_index[{partial_addr, inst->layered}] = (int)partials.size();
+
+			for(int vn = 0; vn < voices_per_note; vn++)
 			{
-				vo->volume = std::clamp(std::min(vo->volume_target, vo->volume + vo->volume_rate_mul), 0, 65535);
+				UPD937_Partial pa;
+				int pitch_env = read_rom_16(ptr_partials + partial_addr + 0);
+				int volume_env = read_rom_16(ptr_partials + partial_addr + 2);
+				int sample_descriptor = read_rom_16(ptr_partials + partial_addr + 4);
+
+				if(!pitch_envelope_index.count(pitch_env))
+				{
+					pitch_envelope_index[pitch_env] = (int)pitch_envelopes.size();
+					pitch_envelopes.push_back(decode_pitch_envelope(pitch_env));
+				}
+				if(!volume_envelope_index.count(volume_env))
+				{
+					volume_envelope_index[volume_env] = (int)volume_envelopes.size();
+					volume_envelopes.push_back(decode_volume_envelope(volume_env));
+				}
+				pa.pitch_env = pitch_envelope_index[pitch_env];
+				pa.volume_env = volume_envelope_index[volume_env];
+
+				// Get sample data
+				pa.sample_note = read_rom_8(ptr_sampdesc + sample_descriptor*10);
+				pa.sample_start = read_rom_24(ptr_sampdesc + sample_descriptor*10 + 1);
+				pa.sample_end = read_rom_24(ptr_sampdesc + sample_descriptor*10 + 4);
+				pa.sample_loop = read_rom_24(ptr_sampdesc + sample_descriptor*10 + 7);
+
+				partials.push_back(pa);
+				partial_addr += 6;
 			}
 		}
-		if(vo->volume > 0)
+	}
+
+	printf("[Sound] Decoded %d partials, %d volume envelopes, %d pitch envelopes\n",
+		(int)partials.size(), (int)volume_envelopes.size(), (int)pitch_envelopes.size());
+}
+
+UPD937_VolumeEnvelope UPD937_Core::decode_volume_envelope(int env)
+{
+	UPD937_VolumeEnvelope ve;
+	for(int s = 0; s < 32; s++)
+	{
+		UPD937_VolumeEnvelopeStep *st = &ve.steps[s];
+		int env_rate = read_rom_8(ptr_volenv + env*64 + s*2 + 0);
+		int env_target = read_rom_8(ptr_volenv + env*64 + s*2 + 1);
+		st->delay = (env_target == 0);
+		st->delay_length = env_rate+1;
+		st->down = (env_rate>=128);
+		st->rate = env_rate & 127;
+		st->target = volume_table[env_target];
+		if(st->rate == 127)
 		{
-			int pitch_relative = vo->pitch;
-			pitch_relative += vo->pitch_env_value/16;
-			pitch_relative += channels[vo->channel].bend_offset;
-			//if(pitch_relative < 0) pitch_relative = 0;
-			//if(pitch_relative > 0x5FF) pitch_relative = 0x5FF;
-			vo->sample_fract += read_rom_16(ptr_pitchtable + pitch_relative*2);
-			if(vo->sample_fract >= 0x8000)
-			{
-				vo->sample_fract -= 0x8000;
-				vo->sample_last_val = (read_rom_16(vo->sample_ptr*2)>>4) - 0x800;
-				vo->sample_ptr++;
-			}
-			if(vo->sample_ptr > vo->sample_end) vo->sample_ptr = vo->sample_loop;
+			st->rate_mul = 0xFFFF;
+			st->rate_div = 1;
+		}
+		else
+		{
+			st->rate_mul = rate_table_mul[st->rate*2 + 2];
+			st->rate_div = rate_table_div[st->rate*2 + 2]+1;
 		}
 	}
+	return ve;
+}
 
-	sample_count++;
+UPD937_PitchEnvelope UPD937_Core::decode_pitch_envelope(int env)
+{
+	UPD937_PitchEnvelope pe;
+	int pitch_initial = read_rom_16(ptr_pitchenv + env*32 + 0);
+	pe.initial_value = (pitch_initial&0xFFF) * ((pitch_initial>=0x1000) ? -1 : 1) * 16;
+	pe.delay = read_rom_16(ptr_pitchenv + env*32 + 2) + 1;
+	for(int s = 0; s < 8; s++)
+	{
+		UPD937_PitchEnvelopeStep *st = &pe.steps[s];
+		int env_rate = read_rom_16(ptr_pitchenv + env*32 + s*4 + 0);
+		int env_target = read_rom_16(ptr_pitchenv + env*32 + s*4 + 2);
+		bool env_down = (env_rate&0x1000) > 0;
+		st->loop = (env_rate&0x2000) > 0;
+		env_rate &= 0xFFF;
+		st->loop_step = env_rate&7;
+		st->rate = env_rate * (env_down ? -1 : 1);
+		st->target = env_target * (env_down ? -16 : 16);
+	}
+	return pe;
 }
 
 void UPD937_Core::update_volume_envelopes()
 {
 	delay_update_phase = (delay_update_phase+1)&1;
-	// Do all at once for now
-	for(int v = 0; v < 32; v++)
+	// Do all at once for now, idle voices are left at zero by their envelopes
+	for(uint32_t mask = active_voices; mask; mask &= mask-1)
 	{
-		UPD937_VoiceState *vo = &voices[v];
+		UPD937_VoiceState *vo = &voices[lowest_set_bit(mask)];
 		bool changed = false;
 		if(vo->volume_env_delay > 0)
 		{
@@ -338,18 +669,17 @@ void UPD937_Core::update_volume_envelopes()
 		while(changed)
 		{
 			changed = false;
-			int env_rate = read_rom_8(ptr_volenv + vo->volume_env*64 + vo->volume_env_step*2 + 0);
-			int env_target = read_rom_8(ptr_volenv + vo->volume_env*64 + vo->volume_env_step*2 + 1);
-			bool env_down = (env_rate>=128);
-			env_rate &= 127;
-			int env_volume_target = read_rom_16(ptr_voltable + env_target*2);
+			const UPD937_VolumeEnvelopeStep *st = &volume_envelopes[vo->volume_env].steps[vo->volume_env_step];
+			bool env_down = st->down;
+			int env_rate = st->rate;
+			int env_volume_target = st->target;
 			// Always process as regular envelope step
 			vo->volume_down = env_down;
 			if(env_rate == 127)
 			{
 				// Instant apply
-				vo->volume_rate_mul = 0xFFFF;
-				vo->volume_rate_div = 1;
+				vo->volume_rate_mul = st->rate_mul;
+				vo->volume_rate_div = st->rate_div;
 			}
 			else if(env_rate == 0 && env_down)
 			{
@@ -372,9 +702,8 @@ void UPD937_Core::update_volume_envelopes()
 			else
 			{
 				// Regular ramp
-				env_rate = (env_rate*2) + 2;
-				vo->volume_rate_mul = read_rom_16(ptr_ratetable + env_rate*4 + 0);
-				vo->volume_rate_div = read_rom_8(ptr_ratetable + env_rate*4 + 2)+1;
+				vo->volume_rate_mul = st->rate_mul;
+				vo->volume_rate_div = st->rate_div;
 			}
 			vo->volume_target = env_volume_target;
 		}
@@ -384,9 +713,9 @@ void UPD937_Core::update_volume_envelopes()
 void UPD937_Core::update_pitch_envelopes()
 {
 	// Do all at once for now
-	for(int v = 0; v < 32; v++)
+	for(uint32_t mask = active_voices; mask; mask &= mask-1)
 	{
-		UPD937_VoiceState *vo = &voices[v];
+		UPD937_VoiceState *vo = &voices[lowest_set_bit(mask)];
 		if(vo->volume == 0) continue; // TODO is this a valid check for this?
 		bool changed = false;
 		// Update delay
@@ -417,21 +746,17 @@ void UPD937_Core::update_pitch_envelopes()
 		while(changed && vo->pitch_env_step < 8)
 		{
 			changed = false;
-			int env_rate = read_rom_16(ptr_pitchenv + vo->pitch_env*32 + vo->pitch_env_step*4 + 0);
-			int env_target = read_rom_16(ptr_pitchenv + vo->pitch_env*32 + vo->pitch_env_step*4 + 2);
-			bool loop_flag = (env_rate&0x2000) > 0;
-			bool env_down = (env_rate&0x1000) > 0;
-			env_rate &= 0xFFF;
-			if(loop_flag)
+			const UPD937_PitchEnvelopeStep *st = &pitch_envelopes[vo->pitch_env].steps[vo->pitch_env_step];
+			if(st->loop)
 			{
-				vo->pitch_env_step = env_rate&7;
+				vo->pitch_env_step = st->loop_step;
 				changed = !already_looped;
 				already_looped = true;
 			}
 			else
 			{
-				vo->pitch_env_rate = env_rate * (env_down ? -1 : 1);
-				vo->pitch_env_target += env_target * (env_down ? -16 : 16);
+				vo->pitch_env_rate = st->rate;
+				vo->pitch_env_target += st->target;
 			}
 		}
 	}
@@ -468,45 +793,34 @@ void UPD937_Core::note_on(int channel, int note)
 	while(note_ranged < 36) note_ranged += 12;
 	while(note_ranged > 96) note_ranged -= 12;
 
-	// Get instrument descriptor
-	int partial_addr = ch->partials_offset;
+	// Get the partials this note plays
+	const UPD937_Instrument *inst = &instruments[ch->instrument];
 	int voices_per_note = ch->layered ? 4 : 2;
+	const UPD937_Partial *pa = &partials[inst->note_partials[note_ranged-36]];
 
-	// Get keymap and update partial address
-	int keymap_byte = (note_ranged-36)/2;
-	int keymap_shift = ((note_ranged-36)&1)*4;
-	int keymap_val = (read_rom_8(ptr_keymaps + ch->keymap_no*32 + keymap_byte) >> keymap_shift) & 0xF;
-
-	// Get partial
-	partial_addr += keymap_val * voices_per_note * 3;
-	// TODO: From here layering needs to be implemented with allocating extra voices
-	partial_addr *= 2;
-
-	for(int vn = 0; vn < voices_per_note; vn++)
+	for(int vn = 0; vn < voices_per_note; vn++, pa++)
 	{
-		UPD937_VoiceState *vo = &voices[get_free_voice(channel)];
+		int v = get_free_voice(channel);
+		wake_voice(v);
+		UPD937_VoiceState *vo = &voices[v];
 
 		// Set basic parameters from the partial
-		vo->pitch_env = read_rom_16(ptr_partials + partial_addr + 0);
-		vo->volume_env = read_rom_16(ptr_partials + partial_addr + 2);
-		int sample_descriptor = read_rom_16(ptr_partials + partial_addr + 4);
-
-		// Get sample data
-		vo->sample_start = read_rom_24(ptr_sampdesc + sample_descriptor*10 + 1);
-		vo->sample_end = read_rom_24(ptr_sampdesc + sample_descriptor*10 + 4);
-		vo->sample_loop = read_rom_24(ptr_sampdesc + sample_descriptor*10 + 7);
+		vo->pitch_env = pa->pitch_env;
+		vo->volume_env = pa->volume_env;
 
 		// Initialize sampler
+		vo->sample_start = pa->sample_start;
+		vo->sample_end = pa->sample_end;
+		vo->sample_loop = pa->sample_loop;
 		vo->sample_ptr = vo->sample_start;
 		vo->sample_fract = 0;
 		vo->sample_last_val = 0; // Hardware might not do this
 
 		// Set note
 		vo->note = note;
-		int sample_note = read_rom_8(ptr_sampdesc + sample_descriptor*10);
-		if(sample_note > 0)
+		if(pa->sample_note > 0)
 		{
-			vo->pitch = (note_ranged - sample_note) * 32;
+			vo->pitch = (note_ranged - pa->sample_note) * 32;
 		}
 		else
 		{
@@ -522,46 +836,32 @@ void UPD937_Core::note_on(int channel, int note)
 		vo->volume_env_delay = 0;
 		vo->volume_env_step = 0;
 
-		// Read first step of envelope
-		int env_rate = read_rom_8(ptr_volenv + vo->volume_env*64 + 0);
-		int env_target = read_rom_8(ptr_volenv + vo->volume_env*64 + 1);
-		if(env_target == 0)
+		// First step of envelope
+		const UPD937_VolumeEnvelopeStep *st = &volume_envelopes[vo->volume_env].steps[0];
+		if(st->delay)
 		{
 			// This is a delay step
-			vo->volume_env_delay = env_rate+1;
+			vo->volume_env_delay = st->delay_length;
 			vo->volume_env_step = 1;
 		}
 		else
 		{
 			// Regular envelope step
-			vo->volume_down = (env_rate>=128);
-			env_rate &= 127;
-			vo->volume_target = read_rom_16(ptr_voltable + env_target*2);
-			if(env_rate == 127)
-			{
-				vo->volume_rate_mul = 0xFFFF;
-				vo->volume_rate_div = 1;
-			}
-			else
-			{
-				env_rate = (env_rate*2) + 2;
-				vo->volume_rate_mul = read_rom_16(ptr_ratetable + env_rate*4 + 0);
-				vo->volume_rate_div = read_rom_8(ptr_ratetable + env_rate*4 + 2)+1;
-			}
+			vo->volume_down = st->down;
+			vo->volume_target = st->target;
+			vo->volume_rate_mul = st->rate_mul;
+			vo->volume_rate_div = st->rate_div;
 		}
 
 		// Set pitch envelope
-		int pitch_initial = read_rom_16(ptr_pitchenv + vo->pitch_env*32 + 0);
-		pitch_initial = (pitch_initial&0xFFF) * ((pitch_initial>=0x1000) ? -1 : 1);
-		vo->pitch_env_value = vo->pitch_env_target = pitch_initial*16;
+		const UPD937_PitchEnvelope *pe = &pitch_envelopes[vo->pitch_env];
+		vo->pitch_env_value = vo->pitch_env_target = pe->initial_value;
 		vo->pitch_env_rate = 0;
-		vo->pitch_env_delay = read_rom_16(ptr_pitchenv + vo->pitch_env*32 + 2) + 1;
+		vo->pitch_env_delay = pe->delay;
 		vo->pitch_env_step = 1;
 
 		vo->active = true;
 		vo->sustained = false;
-
-		partial_addr += 6;
 	}
 }
 
@@ -593,6 +893,7 @@ void UPD937_Core::prog_chg(int channel, int prog)
 	// Silence all notes on this channel by decaying over a 512 sample period
 	for(int v = ch->first_voice; v < ch->first_voice+ch->voice_count; v++)
 	{
+		wake_voice(v);
 		voices[v].active = false;
 		voices[v].sustained = false;
 		voices[v].volume_rate_mul = (voices[v].volume+511)/512;
@@ -607,10 +908,7 @@ void UPD937_Core::prog_chg(int channel, int prog)
 	prog = midi_prog_to_bank(prog, 0);
 	// Update channel's instrument parameters
 	ch->instrument = prog;
-	ch->partials_offset = read_rom_16(ptr_instdesc + prog*4 + 0);
-	ch->keymap_no = read_rom_8(ptr_instdesc + prog*4 + 2);
-	int flags = read_rom_8(ptr_instdesc + prog*4 + 3);
-	ch->layered = (flags & 0x10) > 0;
+	ch->layered = instruments[prog].layered;
 }
 
 void UPD937_Core::pitch_bend(int channel, int bend_byte)
@@ -618,7 +916,7 @@ void UPD937_Core::pitch_bend(int channel, int bend_byte)
 	if(channel < 0 || channel > 3) return;
 	UPD937_ChannelState *ch = &channels[channel];
 	ch->bend_value = bend_byte-128;
-	ch->bend_offset = read_rom_8(ptr_ratetable + bend_byte*4 + 3) - 128;
+	ch->bend_offset = rate_table_bend[bend_byte] - 128;
 }
 
 void UPD937_Core::control_chg_sustain(int channel, bool sustain)
@@ -641,54 +939,196 @@ int UPD937_Core::midi_prog_to_bank(int prog, int bank_select)
 	return prog-10 + bank_select*100 + HC_NUM_BANKS*10;
 }
 
-LoopySound::LoopySound(std::vector<uint8_t>& rom_in, float out_rate, int buffer_size)
+template <typename Func>
+void UPD937_Core::visit_state(Func func)
+{
+	// The same list is used for saving and loading
+	func(voices);
+	func(channels);
+	func(volume_slider);
+	func(active_voices);
+	func(voice_idle_since);
+	func(clk2_counter);
+	func(delay_update_phase);
+	func(sample_count);
+	func(midi_status);
+	func(midi_running_status);
+	func(midi_param_bytes);
+	func(midi_param_count);
+	func(midi_in_sysex);
+}
+
+void UPD937_Core::save_state(Common::StateWriter& writer)
+{
+	// Voices refer to decoded instruments and envelopes by index, which only match for the same ROM
+	writer.write(rom_mask);
+	writer.write((uint32_t)partials.size());
+	visit_state([&](auto& value) { writer.write(value); });
+}
+
+bool UPD937_Core::load_state(Common::StateReader& reader)
+{
+	int saved_rom_mask = reader.read<int>();
+	uint32_t saved_partials = reader.read<uint32_t>();
+	if(saved_rom_mask != rom_mask || saved_partials != partials.size())
+	{
+		printf("[Sound] State is from a different sound ROM\n");
+		reader.fail();
+		return false;
+	}
+	visit_state([&](auto& value) { reader.read(value); });
+	return reader.good();
+}
+
+static size_t get_midi_queue_capacity(float out_rate, int target_latency)
+{
+	// The time reference can run up to twice the target latency ahead of playback
+	float max_buffered_time = 2 * target_latency / out_rate;
+	size_t capacity = 256;
+	while(capacity < MIDI_QUEUE_BYTE_RATE * max_buffered_time) capacity <<= 1;
+	return capacity;
+}
+
+LoopySound::LoopySound(std::vector<uint8_t>& rom_in, const LoopySoundConfig& config)
 {
-	this->out_rate = out_rate;
 	this->synth_rate = TUNING * 192;
-	this->mix_level = MIX_LEVEL;
-	this->buffer_size = buffer_size;
-	printf("[Sound] Init uPD937 core: synth rate %.01f, out rate %.01f, buffer size %d\n", synth_rate, out_rate, buffer_size);
+	printf("[Sound] Init uPD937 core: synth rate %.01f\n", synth_rate);
 	synth = std::make_unique<UPD937_Core>(rom_in, synth_rate);
-	if(FILTER_ENABLE)
+	apply_config(config);
+}
+
+void LoopySound::reconfigure(const LoopySoundConfig& config)
+{
+	// Must not be called while samples are being generated
+	if(config.out_rate != out_rate)
+	{
+		// Queued events are timed in samples at the old rate, so everything still waiting is applied right away
+		flush_queued_events();
+
+		// Start counting the time reference again from the current position
+		time_reference_samples = (int)out_sample_count;
+		rate_ratio = 1.f;
+		rate_time = 0;
+	}
+
+	apply_config(config);
+}
+
+void LoopySound::apply_config(const LoopySoundConfig& config)
+{
+	// Rebuilding the resampler clears its history, so leave it alone unless it has to change
+	bool rebuild_filters = !resampler || config.out_rate != out_rate || config.filter_enable != filter_enable;
+	this->out_rate = config.out_rate;
+	this->filter_enable = config.filter_enable;
+	this->mix_level = config.mix_level;
+	this->buffer_size = config.buffer_size;
+	if(config.target_latency != target_latency) this->fill_average = config.target_latency;
+	this->target_latency = config.target_latency;
+	printf("[Sound] Output: rate %.01f, buffer size %d, target latency %d\n", out_rate, buffer_size, target_latency);
+
+	// It never shrinks, a bit of extra capacity does no harm
+	size_t queue_capacity = get_midi_queue_capacity(out_rate, target_latency);
+	if(!midi_queue || midi_queue->capacity() < queue_capacity)
+	{
+		// Events still waiting for their time move to the new queue, dropping them could leave notes stuck
+		auto new_queue = std::make_unique<Common::SPSCQueue<QueuedEvent>>(queue_capacity);
+		QueuedEvent event;
+		while(midi_queue && midi_queue->pop(event))
+		{
+			new_queue->push(event);
+		}
+		midi_queue = std::move(new_queue);
+		printf("[Sound] MIDI queue capacity %d\n", (int)midi_queue->capacity());
+	}
+
+	if(!rebuild_filters)
+	{
+		return;
+	}
+	if(filter_enable)
 	{
 		printf("[Sound] Init filters\n");
-		filter_tone = std::make_unique<BiquadStereoFilter>(synth_rate, FILTER_CUTOFF, FILTER_RESONANCE, false);
-		filter_block_dc = std::make_unique<BiquadStereoFilter>(out_rate, 20.f, 0.7f, true);
+		// The tone filter is folded into the resampler
+		BiquadStereoFilter filter_tone(synth_rate, FILTER_CUTOFF, FILTER_RESONANCE, false);
+		resampler = std::make_unique<PolyphaseResampler>(synth_rate, out_rate, &filter_tone);
+		if(filter_block_dc) filter_block_dc->set_fs(out_rate);
+		else filter_block_dc = std::make_unique<BiquadStereoFilter>(out_rate, 20.f, 0.7f, true);
 	}
 	else
 	{
-		filter_tone = nullptr;
+		resampler = std::make_unique<PolyphaseResampler>(synth_rate, out_rate, nullptr);
 		filter_block_dc = nullptr;
 	}
 }
 
-void LoopySound::gen_sample(float out[])
+void LoopySound::render_block(float out[], int frames)
 {
-	// Process midi events every 64 samples
-	if((out_sample_count & 63) == 0)
+	// Output is interleaved stereo
+	int done = 0;
+	while(done < frames)
 	{
-		handle_midi_event();
+		// Process midi events and adjust the playback rate every 64 samples
+		if((gen_sample_count & 63) == 0)
+		{
+			stat_midi_queue_depth.add((uint32_t)midi_queue->size());
+			handle_midi_event();
+			update_rate_control();
+		}
+		int n = std::min(frames - done, 64 - (gen_sample_count & 63));
+		render_chunk(out + done*2, n);
+		gen_sample_count += n;
+		done += n;
 	}
-	interpolation_step += synth_rate / out_rate;
-	while(interpolation_step >= 1.f)
+}
+
+void LoopySound::render_chunk(float out[], int frames)
+{
+	// Work out how many synth samples each output sample steps over, then synthesize them all at once
+	float step = synth_rate / out_rate * rate_ratio;
+	int synth_steps[64];
+	int synth_count = 0;
+	float interpolation_end = interpolation_step;
+	for(int i = 0; i < frames; i++)
+	{
+		interpolation_end += step;
+		synth_steps[i] = 0;
+		while(interpolation_end >= 1.f)
+		{
+			synth_steps[i]++;
+			interpolation_end--;
+		}
+		synth_count += synth_steps[i];
+	}
+	if((int)synth_buffer.size() < synth_count*2) synth_buffer.resize(synth_count*2);
+	synth->render_block(synth_buffer.data(), synth_count);
+
+	const int *raw_samples = synth_buffer.data();
+	for(int i = 0; i < frames; i++)
 	{
-		last_sample[0] = current_sample[0];
-		last_sample[1] = current_sample[1];
-		synth->gen_sample(raw_samples);
-		// Get synth sample and filter it at synth rate
-		current_sample[0] = raw_samples[0] / 32768.f;
-		current_sample[1] = raw_samples[1] / 32768.f;
-		if(filter_tone) filter_tone->process(current_sample);
-		interpolation_step--;
+		interpolation_step += step;
+		for(int j = 0; j < synth_steps[i]; j++)
+		{
+			// Feed synth samples to the resampler, which filters them as well
+			synth_sample[0] = raw_samples[0] / 32768.f;
+			synth_sample[1] = raw_samples[1] / 32768.f;
+			resampler->push(synth_sample);
+			raw_samples += 2;
+			interpolation_step--;
+		}
+		// Resample and mix at out rate
+		resampler->get(mix_sample, interpolation_step);
+		mix_sample[0] *= 6.8f * mix_level;
+		mix_sample[1] *= 6.8f * mix_level;
+		if(filter_block_dc) filter_block_dc->process(mix_sample);
+		// Write output
+		out[i*2+0] = std::clamp(mix_sample[0], -1.f, 1.f);
+		out[i*2+1] = std::clamp(mix_sample[1], -1.f, 1.f);
+		// Emulated time passes slightly faster or slower than output samples while the rate is adjusted
+		rate_time += rate_ratio;
+		int rate_samples = (int)rate_time;
+		rate_time -= rate_samples;
+		out_sample_count += rate_samples;
 	}
-	// Resample and mix at out rate
-	mix_sample[0] = (last_sample[0] + (current_sample[0]-last_sample[0]) * interpolation_step) * 6.8f * mix_level;
-	mix_sample[1] = (last_sample[1] + (current_sample[1]-last_sample[1]) * interpolation_step) * 6.8f * mix_level;
-	if(filter_block_dc) filter_block_dc->process(mix_sample);
-	// Write output
-	out[0] = std::clamp(mix_sample[0], -1.f, 1.f);
-	out[1] = std::clamp(mix_sample[1], -1.f, 1.f);
-	out_sample_count++;
 }
 
 void LoopySound::set_channel_muted(int channel, bool mute)
@@ -697,24 +1137,72 @@ void LoopySound::set_channel_muted(int channel, bool mute)
 }
 
 void LoopySound::time_reference(float delta)
+{
+	advance_time_reference((delta > 0) ? (int)floor(delta * out_rate) : 0);
+}
+
+void LoopySound::advance_time_reference(int delta_samples)
 {
 	has_time_reference = true;
-	if(delta > 0)
-	{
-		int delta_samples = (int)floor(delta * out_rate);
-		time_reference_samples += delta_samples;
-	}
+	time_reference_samples += delta_samples;
 
 	// Hard correction, keep within sane distance of local time
-	int clamp_range = 2 * buffer_size;
-	time_reference_samples = std::clamp(time_reference_samples, out_sample_count, out_sample_count + clamp_range);
+	// Smaller differences are evened out by the rate control instead
+	int clamp_range = 2 * target_latency;
+	int local_time = out_sample_count;
+	int unclamped = time_reference_samples;
+	int clamped = std::clamp(unclamped, local_time, local_time + clamp_range);
+	time_reference_samples = clamped;
+	if(clamped != unclamped) stat_time_corrections.add(std::abs(unclamped - clamped));
+}
+
+void LoopySound::set_rate_control(bool enable)
+{
+	// Only needed against the clock drift of a real audio device
+	rate_control = enable;
+	if(!enable) rate_ratio = 1.f;
+	stat_rate_ratio.store(rate_ratio, std::memory_order_relaxed);
+}
 
-	// Soft correction, slowly drift towards local time (middle of hard range)
-	// This introduces some relative error but biases it to hit hard limits less often
-	time_reference_samples += (out_sample_count + buffer_size - time_reference_samples + 32) >> 6;
+int LoopySound::get_time_reference()
+{
+	return time_reference_samples;
+}
+
+int LoopySound::get_sample_count()
+{
+	return out_sample_count;
+}
+
+void LoopySound::update_rate_control()
+{
+	if(!has_time_reference || !rate_control) return;
+
+	// The fill level drops by a whole buffer on every callback, so follow its average
+	int fill = time_reference_samples - out_sample_count;
+	fill_average += (fill - fill_average) / 256.f;
+
+	// Samples are generated a whole buffer at a time before they play, so on average half a buffer less is left
+	float error = fill_average - (target_latency - buffer_size * 0.5f);
+
+	// Leave the rate alone close to the target, where pacing the emulator holds the latency by itself
+	float deadband = out_rate / 100;
+	if(error > deadband) error -= deadband;
+	else if(error < -deadband) error += deadband;
+	else error = 0;
+
+	// Play faster when too much is buffered and slower when too little is
+	rate_ratio = 1.f + std::clamp(error / (buffer_size * 0.5f), -1.f, 1.f) * MAX_RATE_ADJUST;
+	stat_rate_ratio.store(rate_ratio, std::memory_order_relaxed);
 }
 
 void LoopySound::set_control_register(int creg)
+{
+	// The synth is only touched on the audio thread
+	enqueue_event(creg, true);
+}
+
+void LoopySound::apply_control_register(int creg)
 {
 	creg &= 0xFFF;
 	// Handle volume sliders
@@ -775,39 +1263,128 @@ void LoopySound::set_control_register(int creg)
 
 bool LoopySound::midi_in(char b)
 {
-	// temporarily ignore midi here when in demo or keyboard mode
-	if(in_demo || (channel_config_state == 0)) return true;
-	return enqueue_midi_byte(b, time_reference_samples);
+	return enqueue_event(b & 0xFF, false);
 }
 
-bool LoopySound::enqueue_midi_byte(char midi_byte, int timestamp)
+void LoopySound::apply_queued_events()
 {
-	if((queue_write + 1) % MIDI_QUEUE_CAPACITY == queue_read)
+	// For when the synth runs on the same thread as the emulator, and events don't have to wait for their time
+	handle_midi_event();
+}
+
+void LoopySound::flush_queued_events()
+{
+	bool had_time_reference = has_time_reference;
+	has_time_reference = false;
+	handle_midi_event();
+	has_time_reference = had_time_reference;
+}
+
+bool LoopySound::enqueue_event(int value, bool is_control)
+{
+	QueuedEvent* event = midi_queue->write_slot();
+	if(!event)
 	{
 		if(!midi_overflowed) printf("[Sound] MIDI queue overflow, increase queue capacity or send smaller groups more often.\n");
 		midi_overflowed = true;
+		stat_midi_overflows.store(stat_midi_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 		return false;
 	}
 	midi_overflowed = false;
-	midi_queue_bytes[queue_write] = midi_byte;
-	midi_queue_timestamps[queue_write] = timestamp;
-	queue_write = (queue_write + 1) % MIDI_QUEUE_CAPACITY;
+	event->timestamp = time_reference_samples;
+	event->value = value;
+	event->is_control = is_control;
+	midi_queue->commit_write();
 	return true;
 }
 
 void LoopySound::handle_midi_event()
 {
-	while(queue_write != queue_read)
+	QueuedEvent* event;
+	while((event = midi_queue->read_slot()))
 	{
-		int event_time = midi_queue_timestamps[queue_read];
-		int time_diff = (event_time - out_sample_count); // wraparound taken care of here
+		int time_diff = (event->timestamp - out_sample_count); // wraparound taken care of here
 		if(has_time_reference && time_diff > 0) break;
-		char event_byte = midi_queue_bytes[queue_read];
-		queue_read = (queue_read + 1) % MIDI_QUEUE_CAPACITY;
-		synth->process_midi_now(event_byte);
+		if(has_time_reference) stat_midi_lateness.add(-time_diff);
+		if(event->is_control)
+		{
+			apply_control_register(event->value);
+		}
+		else if(!in_demo && (channel_config_state != 0))
+		{
+			// temporarily ignore midi here when in demo or keyboard mode
+			synth->process_midi_now((char)event->value);
+		}
+		midi_queue->commit_read();
 	}
 }
 
+void LoopySound::save_state(Common::StateWriter& writer)
+{
+	synth->save_state(writer);
+	writer.write(buttons_last);
+	writer.write(channel_config_state);
+	writer.write(in_demo);
+	// How far the output is between two synth samples decides how many the synth renders next
+	writer.write(interpolation_step);
+
+	// Queued events are saved with how long they still had to wait, in case the output rate is different when loaded
+	writer.write(out_rate);
+	writer.write((uint32_t)midi_queue->size());
+	for(size_t i = 0; i < midi_queue->size(); i++)
+	{
+		QueuedEvent event = midi_queue->peek(i);
+		event.timestamp -= out_sample_count;
+		writer.write(event);
+	}
+}
+
+bool LoopySound::load_state(Common::StateReader& reader)
+{
+	if(!synth->load_state(reader)) return false;
+	reader.read(buttons_last);
+	reader.read(channel_config_state);
+	reader.read(in_demo);
+	reader.read(interpolation_step);
+
+	float saved_rate = reader.read<float>();
+	uint32_t event_count = reader.read<uint32_t>();
+	if(!reader.good() || event_count > midi_queue->capacity())
+	{
+		reader.fail();
+		return false;
+	}
+	std::vector<QueuedEvent> events(event_count);
+	for(auto& event : events) reader.read(event);
+	if(!reader.good()) return false;
+
+	// Whatever was queued belongs to the timeline that was left, the saved events take its place
+	midi_queue->clear();
+	midi_overflowed = false;
+	float rate_scale = (saved_rate > 0) ? out_rate / saved_rate : 1.f;
+	for(auto& event : events)
+	{
+		// Fits, as the queue was just emptied and holds at least as many as were saved
+		QueuedEvent* slot = midi_queue->write_slot();
+		*slot = event;
+		slot->timestamp = out_sample_count + (int)(event.timestamp * rate_scale);
+		midi_queue->commit_write();
+	}
+	return true;
+}
+
+LoopySoundStats LoopySound::get_stats() const
+{
+	// Safe from any thread
+	LoopySoundStats stats;
+	stats.midi_queue_depth = stat_midi_queue_depth.snapshot();
+	stats.midi_lateness = stat_midi_lateness.snapshot();
+	stats.midi_overflows = stat_midi_overflows.load(std::memory_order_relaxed);
+	stats.time_corrections = stat_time_corrections.snapshot();
+	stats.rate_ratio = stat_rate_ratio.load(std::memory_order_relaxed);
+	return stats;
+}
+
 BiquadStereoFilter::BiquadStereoFilter(float fs, float fc, float q, bool hp)
 {
 	reset();
@@ -892,4 +1469,165 @@ void BiquadStereoFilter::update_coefficients()
 	}
 }
 
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	for(int k = 1; k < 32; k++)
+	{
+		term *= (x / (2*k)) * (x / (2*k));
+		sum += term;
+	}
+	return sum;
+}
+
+// Low pass windowed sinc, t in input samples and fc in cycles per input sample
+static double windowed_sinc(double t, double fc)
+{
+	constexpr static double PI = 3.14159265358979323846;
+	double r = t / RESAMPLER_SINC_HALF_WIDTH;
+	if(r <= -1 || r >= 1) return 0;
+	double sinc = (t == 0) ? 1 : sin(2*PI*fc*t) / (2*PI*fc*t);
+	double window = bessel_i0(RESAMPLER_KAISER_BETA * sqrt(1 - r*r)) / bessel_i0(RESAMPLER_KAISER_BETA);
+	return 2*fc * sinc * window;
 }
+
+PolyphaseResampler::PolyphaseResampler(float in_rate, float out_rate, BiquadStereoFilter *prefilter)
+{
+	// The prefilter is applied at the input rate, so its impulse response can be convolved into the kernel
+	constexpr static int PREFILTER_TAPS = RESAMPLER_TAPS - 2*RESAMPLER_SINC_HALF_WIDTH;
+	float impulse_response[PREFILTER_TAPS] = {1.f};
+	if(prefilter)
+	{
+		prefilter->reset();
+		for(int m = 0; m < PREFILTER_TAPS; m++)
+		{
+			float sample[2] = {(m == 0) ? 1.f : 0.f, 0.f};
+			prefilter->process(sample);
+			impulse_response[m] = sample[0];
+		}
+		prefilter->reset();
+	}
+
+	// Band limit to whichever rate is lower
+	double fc = 0.5 * std::min(in_rate, out_rate) / in_rate * RESAMPLER_CUTOFF;
+
+	// Tap j holds the input sample that is RESAMPLER_TAPS-1-j samples older than the newest one,
+	// and the output lies RESAMPLER_SINC_HALF_WIDTH samples behind the newest one plus the phase
+	coefficients.resize((RESAMPLER_PHASES+1) * RESAMPLER_TAPS);
+	for(int p = 0; p <= RESAMPLER_PHASES; p++)
+	{
+		float *kernel = &coefficients[p * RESAMPLER_TAPS];
+		double fract = (double)p / RESAMPLER_PHASES;
+
+		// Within a phase the sinc is only ever evaluated at whole sample offsets from the output
+		double sinc[RESAMPLER_TAPS + PREFILTER_TAPS];
+		for(int n = 0; n < RESAMPLER_TAPS + PREFILTER_TAPS; n++)
+		{
+			sinc[n] = windowed_sinc(RESAMPLER_TAPS-1 - RESAMPLER_SINC_HALF_WIDTH - n + fract, fc);
+		}
+
+		double sum = 0;
+		for(int j = 0; j < RESAMPLER_TAPS; j++)
+		{
+			double k = 0;
+			for(int m = 0; m < PREFILTER_TAPS; m++)
+			{
+				k += impulse_response[m] * sinc[j + m];
+			}
+			kernel[j] = (float)k;
+			sum += k;
+		}
+		// Keep unity gain at DC for every phase
+		for(int j = 0; j < RESAMPLER_TAPS; j++)
+		{
+			kernel[j] = (float)(kernel[j] / sum);
+		}
+	}
+
+	reset();
+}
+
+void PolyphaseResampler::reset()
+{
+	memset(history, 0, sizeof(history));
+	history_pos = 0;
+}
+
+void PolyphaseResampler::push(const float sample[])
+{
+	for(int c = 0; c < 2; c++)
+	{
+		history[c][history_pos] = sample[c];
+		history[c][history_pos + RESAMPLER_TAPS] = sample[c];
+	}
+	history_pos = (history_pos + 1) % RESAMPLER_TAPS;
+}
+
+void PolyphaseResampler::get(float out[], float fract)
+{
+	// Interpolate between the kernels of the two nearest phases
+	float phase = fract * RESAMPLER_PHASES;
+	int p = std::clamp((int)phase, 0, RESAMPLER_PHASES-1);
+	float weight = phase - p;
+	const float *k0 = &coefficients[p * RESAMPLER_TAPS];
+	const float *k1 = k0 + RESAMPLER_TAPS;
+	const float *left = &history[0][history_pos];
+	const float *right = &history[1][history_pos];
+
+	int j = 0;
+#if defined(__AVX__)
+	__m256 weight_vec = _mm256_set1_ps(weight);
+	__m256 sum_l = _mm256_setzero_ps();
+	__m256 sum_r = _mm256_setzero_ps();
+	for(; j + 8 <= RESAMPLER_TAPS; j += 8)
+	{
+		__m256 c0 = _mm256_loadu_ps(k0 + j);
+		__m256 c1 = _mm256_loadu_ps(k1 + j);
+		__m256 c = _mm256_add_ps(c0, _mm256_mul_ps(_mm256_sub_ps(c1, c0), weight_vec));
+		sum_l = _mm256_add_ps(sum_l, _mm256_mul_ps(c, _mm256_loadu_ps(left + j)));
+		sum_r = _mm256_add_ps(sum_r, _mm256_mul_ps(c, _mm256_loadu_ps(right + j)));
+	}
+	float lanes_l[8], lanes_r[8];
+	_mm256_storeu_ps(lanes_l, sum_l);
+	_mm256_storeu_ps(lanes_r, sum_r);
+	float acc_l = 0, acc_r = 0;
+	for(int i = 0; i < 8; i++)
+	{
+		acc_l += lanes_l[i];
+		acc_r += lanes_r[i];
+	}
+#elif defined(__SSE2__)
+	__m128 weight_vec = _mm_set1_ps(weight);
+	__m128 sum_l = _mm_setzero_ps();
+	__m128 sum_r = _mm_setzero_ps();
+	for(; j + 4 <= RESAMPLER_TAPS; j += 4)
+	{
+		__m128 c0 = _mm_loadu_ps(k0 + j);
+		__m128 c1 = _mm_loadu_ps(k1 + j);
+		__m128 c = _mm_add_ps(c0, _mm_mul_ps(_mm_sub_ps(c1, c0), weight_vec));
+		sum_l = _mm_add_ps(sum_l, _mm_mul_ps(c, _mm_loadu_ps(left + j)));
+		sum_r = _mm_add_ps(sum_r, _mm_mul_ps(c, _mm_loadu_ps(right + j)));
+	}
+	float lanes_l[4], lanes_r[4];
+	_mm_storeu_ps(lanes_l, sum_l);
+	_mm_storeu_ps(lanes_r, sum_r);
+	float acc_l = 0, acc_r = 0;
+	for(int i = 0; i < 4; i++)
+	{
+		acc_l += lanes_l[i];
+		acc_r += lanes_r[i];
+	}
+#else
+	float acc_l = 0, acc_r = 0;
+#endif
+	for(; j < RESAMPLER_TAPS; j++)
+	{
+		float c = k0[j] + (k1[j] - k0[j]) * weight;
+		acc_l += c * left[j];
+		acc_r += c * right[j];
+	}
+	out[0] = acc_l;
+	out[1] = acc_r;
+}
+
+}
\ No newline at end of file
@@ -16,9 +16,18 @@ Game support notes:
 */
 
 #pragma once
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <vector>
+#include <common/histogram.h>
+#include <common/spsc_queue.h>
+
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
 
 namespace LoopySound
 {
@@ -29,16 +38,27 @@ namespace LoopySound
 // Standard is 442Hz (internal sample rate 84864Hz).
 constexpr static float TUNING = 442.f;
 
-// Final mix level after amplification circuit.
-// Comfortable listening level is around 0.7 to 0.8, typical hardware level 0.62.
-constexpr static float MIX_LEVEL = 0.7f;
-
 // Filters affects both high and low frequencies to approximate the hardware's resonant LPF.
 // Cutoff and resonance derived from theoretical circuit analysis.
-constexpr static bool FILTER_ENABLE = true;
 constexpr static float FILTER_CUTOFF = 8247.f;
 constexpr static float FILTER_RESONANCE = 1.67f;
 
+// Synth output is resampled with a windowed sinc that also carries the tone filter's response.
+// Its half width in synth samples sets the latency, the rest of the taps hold the tone filter's impulse response.
+constexpr static int RESAMPLER_PHASES = 256;
+constexpr static int RESAMPLER_SINC_HALF_WIDTH = 16;
+constexpr static int RESAMPLER_TAPS = 80;
+constexpr static float RESAMPLER_CUTOFF = 0.72f; // Relative to the lower of the two Nyquist rates
+constexpr static float RESAMPLER_KAISER_BETA = 8.f;
+
+// Mix voices with SSE2/AVX2 where the compiler targets them.
+// The scalar mixer gives bit-identical output, disable to validate against it.
+constexpr static bool SIMD_MIX_ENABLE = true;
+
+// Dynamic rate control speeds up or slows down playback by up to this much to hold the target latency.
+// Around 0.5% is not audible as a pitch change.
+constexpr static float MAX_RATE_ADJUST = 0.005f;
+
 /* Audio synthesis parameters end*/
 
 
@@ -49,15 +69,69 @@ constexpr static int HC_PITCHTABLE = 0x1600;
 constexpr static int HC_INSTDESC = 0x2200;
 constexpr static int HC_KEYMAPS = 0x3DA0;
 constexpr static int HC_NUM_BANKS = 1;
+constexpr static int HC_NUM_INSTRUMENTS = HC_NUM_BANKS*10 + 100;
+
+// Number of entries in each table, which are laid out back to back
+constexpr static int HC_RATETABLE_SIZE = (HC_VOLTABLE - HC_RATETABLE) / 4;
+constexpr static int HC_VOLTABLE_SIZE = (HC_PITCHTABLE - HC_VOLTABLE) / 2;
+constexpr static int HC_PITCHTABLE_SIZE = (HC_INSTDESC - HC_PITCHTABLE) / 2;
 
 // Pitch envelopes update at MIDICLK(4M)/32768 instead of using main clock
 // So we need to approximate 4M/32768 clock from sample rate
 constexpr static int CLK2_MUL = 15625;
 constexpr static int CLK2_DIVP = 128;
 
-// Big enough midi retiming queue for >250ms audio buffer.
-// Could be a lot lower for realtime midi. Must be a power of 2.
-constexpr static int MIDI_QUEUE_CAPACITY = 2048;
+// Blocks are synthesized in segments of at most this many samples, split at envelope clocks
+constexpr static int SYNTH_SEGMENT_SIZE = 256;
+
+// The midi retiming queue is sized to hold this many bytes per second of buffered audio.
+// MIDI itself carries up to 3125 bytes per second, the rest is headroom for bursts.
+constexpr static int MIDI_QUEUE_BYTE_RATE = 12500;
+
+// Instrument data decoded from the ROM up front, so that note-on and envelope steps don't have to parse it
+struct UPD937_VolumeEnvelopeStep
+{
+	uint8_t rate; // 0 to 127
+	bool down;
+	bool delay; // Only meaningful as the first step, where it holds off the envelope by delay_length updates
+	uint16_t delay_length;
+	uint16_t target; // Already mapped through the volume table
+	uint16_t rate_mul, rate_div; // For a ramp at this rate, or an instant step at 127
+};
+
+struct UPD937_VolumeEnvelope
+{
+	// 16 attack/decay steps followed by 16 release steps
+	UPD937_VolumeEnvelopeStep steps[32];
+};
+
+struct UPD937_PitchEnvelopeStep
+{
+	bool loop; // Jump to loop_step instead of ramping
+	uint8_t loop_step;
+	int16_t rate;
+	int32_t target; // Relative to the previous one
+};
+
+struct UPD937_PitchEnvelope
+{
+	int initial_value, delay;
+	UPD937_PitchEnvelopeStep steps[8];
+};
+
+struct UPD937_Partial
+{
+	int pitch_env, volume_env; // Indices into the decoded envelopes
+	int sample_start, sample_end, sample_loop;
+	int sample_note; // 0 for unpitched samples
+};
+
+struct UPD937_Instrument
+{
+	bool layered;
+	// First of the 2 (or 4 if layered) partials played by each note from 36 to 96
+	int note_partials[61];
+};
 
 struct UPD937_VoiceState
 {
@@ -72,6 +146,15 @@ struct UPD937_VoiceState
 	bool sample_new;
 };
 
+// Per-sample interpolation inputs of the voice being mixed, laid out for the SIMD mixer
+struct UPD937_MixBuffer
+{
+	int last_val[SYNTH_SEGMENT_SIZE];
+	int next_val[SYNTH_SEGMENT_SIZE];
+	int fract[SYNTH_SEGMENT_SIZE];
+	int volume[SYNTH_SEGMENT_SIZE];
+};
+
 struct UPD937_ChannelState
 {
 	bool midi_enabled;
@@ -80,8 +163,6 @@ struct UPD937_ChannelState
 	bool sustain;
 	// Current instrument parameters
 	int instrument;
-	int partials_offset;
-	int keymap_no;
 	bool layered;
 	int bend_offset, bend_value;
 	// Voice allocator
@@ -98,6 +179,20 @@ private:
 	std::unique_ptr<uint8_t[]> rom;
 	int rom_mask;
 
+	// ROM contents decoded once up front for the synthesis loops
+	// PCM samples are 12-bit, stored in the upper bits of each 16-bit word
+	std::unique_ptr<int16_t[]> pcm;
+	int pcm_mask;
+	uint16_t rate_table_mul[HC_RATETABLE_SIZE];
+	uint8_t rate_table_div[HC_RATETABLE_SIZE];
+	uint8_t rate_table_bend[HC_RATETABLE_SIZE];
+	uint16_t volume_table[HC_VOLTABLE_SIZE];
+	uint16_t pitch_table[HC_PITCHTABLE_SIZE];
+	UPD937_Instrument instruments[HC_NUM_INSTRUMENTS];
+	std::vector<UPD937_Partial> partials;
+	std::vector<UPD937_VolumeEnvelope> volume_envelopes;
+	std::vector<UPD937_PitchEnvelope> pitch_envelopes;
+
 	// Global state
 	uint32_t ptr_partials;
 	uint32_t ptr_pitchenv;
@@ -114,6 +209,12 @@ private:
 	UPD937_VoiceState voices[32];
 	UPD937_ChannelState channels[32];
 	int volume_slider[2] = {};
+	UPD937_MixBuffer mix_buffer;
+
+	// Voices that are sounding or have an envelope in progress, one bit per voice
+	// The rest are silent until woken by a note or program change, and are skipped entirely
+	uint32_t active_voices = 0;
+	uint32_t voice_idle_since[32];
 
 	// Timer state
 	int clk2_counter = 0;
@@ -132,17 +233,29 @@ private:
 
 public:
 	UPD937_Core(std::vector<uint8_t>& rom_in, float synthesis_rate);
-	void gen_sample(int out[]);
+	void render_block(int out[], int frames);
 	void set_channel_configuration(bool multi, bool all);
 	void set_volume_slider(int group, int slider);
 	void set_channel_muted(int channel, bool mute);
 	void reset_channels(bool clear_program);
 	void process_midi_now(char midi_byte);
+	// Only the synthesis state is saved, tables decoded from the ROM stay as they are
+	void save_state(Common::StateWriter& writer);
+	bool load_state(Common::StateReader& reader);
 private:
+	template <typename Func> void visit_state(Func func);
 	int read_rom_8(int offset);
 	int read_rom_16(int offset);
 	int read_rom_24(int offset);
-	void update_sample();
+	int read_pcm(int sample_ptr);
+	int read_pitch_table(int index);
+	void decode_rom_tables();
+	void decode_instruments();
+	UPD937_VolumeEnvelope decode_volume_envelope(int env);
+	UPD937_PitchEnvelope decode_pitch_envelope(int env);
+	void render_segment(int out[], int frames);
+	void wake_voice(int v);
+	bool is_voice_silent(UPD937_VoiceState *vo);
 	void update_volume_envelopes();
 	void update_pitch_envelopes();
 	int get_free_voice(int c);
@@ -181,51 +294,128 @@ private:
 	void update_coefficients();
 };
 
+class PolyphaseResampler
+{
+private:
+	// Kernel for each of the phases between two input samples, plus one more to interpolate towards
+	std::vector<float> coefficients;
+	// Input history, written twice so that the last RESAMPLER_TAPS samples are always contiguous
+	float history[2][RESAMPLER_TAPS*2];
+	int history_pos;
+
+public:
+	PolyphaseResampler(float in_rate, float out_rate, BiquadStereoFilter *prefilter);
+	void reset();
+	void push(const float sample[]);
+	void get(float out[], float fract);
+};
+
+// Output parameters, which can be changed while running
+struct LoopySoundConfig
+{
+	float out_rate;
+	int buffer_size;
+	int target_latency;
+	// Final mix level after amplification circuit, typical hardware level 0.62
+	float mix_level;
+	// Filters affect both high and low frequencies to approximate the hardware's resonant LPF
+	bool filter_enable;
+};
+
+// Timing statistics of the MIDI retiming, counted from construction
+struct LoopySoundStats
+{
+	Common::Histogram::Snapshot midi_queue_depth; // Queued events every 64 samples
+	Common::Histogram::Snapshot midi_lateness; // Samples each event played after its timestamp
+	uint64_t midi_overflows; // Events dropped because the queue was full
+	Common::Histogram::Snapshot time_corrections; // Samples the time reference was moved by to stay near playback
+	float rate_ratio; // Current playback speed set by the rate control
+};
+
 class LoopySound
 {
 private:
 	std::unique_ptr<UPD937_Core> synth;
-	std::unique_ptr<BiquadStereoFilter> filter_tone;
+	std::unique_ptr<PolyphaseResampler> resampler;
 	std::unique_ptr<BiquadStereoFilter> filter_block_dc;
 
 	// Audio parameters
 	float mix_level;
-	float out_rate;
+	bool filter_enable = false;
+	float out_rate = 0;
 	float synth_rate;
 	int buffer_size;
 
 	// Interpolation state
-	int raw_samples[2] = {};
-	float current_sample[2] = {};
-	float last_sample[2] = {};
+	float synth_sample[2] = {};
 	float mix_sample[2] = {};
 	float interpolation_step = 0;
+	std::vector<int> synth_buffer;
 
 	// Timing correction
-	int out_sample_count = 0;
-	int time_reference_samples = 0;
-	bool has_time_reference = false;
+	// The time reference is advanced by the emulator while samples are generated on the audio thread
+	int gen_sample_count = 0;
+	std::atomic<int> out_sample_count = 0;
+	std::atomic<int> time_reference_samples = 0;
+	std::atomic<bool> has_time_reference = false;
+
+	// Dynamic rate control
+	bool rate_control = true;
+	int target_latency = 0;
+	float fill_average = 0;
+	float rate_ratio = 1.f;
+	float rate_time = 0;
 
 	// Interface state
 	int buttons_last = 0;
 	int channel_config_state = 0;
 	bool in_demo = false;
 
-	// MIDI retiming queue
-	char midi_queue_bytes[MIDI_QUEUE_CAPACITY];
-	int midi_queue_timestamps[MIDI_QUEUE_CAPACITY];
-	int queue_write = 0, queue_read = 0;
+	// MIDI retiming queue, written by the emulator and read by the audio thread
+	// Control register writes go through it too, so that they stay in order with the MIDI bytes
+	struct QueuedEvent
+	{
+		int timestamp;
+		int value;
+		bool is_control;
+	};
+
+	std::unique_ptr<Common::SPSCQueue<QueuedEvent>> midi_queue;
 	bool midi_overflowed = false;
 
+	// Statistics, each only written by the thread that does the work it counts
+	Common::Histogram stat_midi_queue_depth;
+	Common::Histogram stat_midi_lateness;
+	Common::Histogram stat_time_corrections;
+	std::atomic<uint64_t> stat_midi_overflows = 0;
+	std::atomic<float> stat_rate_ratio = 1.f;
+
 public:
-	LoopySound(std::vector<uint8_t>& rom_in, float out_rate, int buffer_size);
-	void gen_sample(float out[]);
+	LoopySound(std::vector<uint8_t>& rom_in, const LoopySoundConfig& config);
+	void reconfigure(const LoopySoundConfig& config);
+	void render_block(float out[], int frames);
 	void set_channel_muted(int channel, bool mute);
 	void time_reference(float delta);
+	void advance_time_reference(int delta_samples);
+	void set_rate_control(bool enable);
+	int get_time_reference();
+	int get_sample_count();
 	void set_control_register(int creg);
 	bool midi_in(char b);
+	void apply_queued_events();
+	// Applies every queued event right away, however long it still had to wait. Must not be called while samples are being generated.
+	void flush_queued_events();
+	LoopySoundStats get_stats() const;
+	// Saves the synth and the events still waiting in the queue, but not the output stage, which keeps playing
+	// from where it is. Must not be called while samples are being generated.
+	void save_state(Common::StateWriter& writer);
+	bool load_state(Common::StateReader& reader);
 private:
-	bool enqueue_midi_byte(char midi_byte, int timestamp);
+	void apply_config(const LoopySoundConfig& config);
+	bool enqueue_event(int value, bool is_control);
+	void apply_control_register(int creg);
+	void update_rate_control();
+	void render_chunk(float out[], int frames);
 	void handle_midi_event();
 };
 
@@ -16,14 +16,21 @@ Game support notes:
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include <SDL.h>
 
+#include <common/state.h>
 #include <core/timing.h>
 #include <sound/sound.h>
 #include <sound/loopysound.h>
@@ -33,15 +40,32 @@ namespace Sound
 
 static Timing::FuncHandle timeref_func;
 static Timing::EventHandle timeref_ev;
+static int64_t timeref_due; // Emulated time of the next timeref event
 
 static std::unique_ptr<LoopySound::LoopySound> sound_engine;
 
+// Parameters requested by the frontend, and the output format actually in use
+static Config::SoundInfo sound_config;
 static int sample_rate;
 static int buffer_size;
+static int target_latency;
+static bool timeref_enable;
+
+// Sample count and time in microseconds of the last callback, packed together so they are always read as a pair
+static std::atomic<uint64_t> last_callback;
 
 static bool mute = false;
 static float volume_level; // Automatically managed by mute
 
+// Set while the emulator runs frames that are thrown away again, nothing from those may be heard
+static bool suspended;
+
+// Set while the emulator runs as fast as it can, which playback can't follow
+static std::atomic<bool> fast_forward;
+
+// Set while the emulator steps back through rewind snapshots, which would only sound like noise
+static std::atomic<bool> rewinding;
+
 static void buffer_callback(float* buffer, uint32_t count);
 
 /* SDL-specific code start */
@@ -55,22 +79,15 @@ static void sdl_audio_callback(void* userdata, uint8_t* raw_buffer, int len)
 	buffer_callback(sample_buffer, sample_count);
 }
 
-static bool sdl_audio_initialize()
+static bool sdl_audio_open()
 {
-	// Initialize SDL audio subsystem if available
-	if(SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
-	{
-		printf("[Sound] SDL audio unavailable: %s\n", SDL_GetError());
-		return false;
-	}
-
 	// Set up desired audio format
 	SDL_AudioSpec format_desired;
 	SDL_zero(format_desired);
-	format_desired.freq = TARGET_SAMPLE_RATE;
+	format_desired.freq = sound_config.sample_rate;
 	format_desired.format = AUDIO_F32SYS;
 	format_desired.channels = 2;
-	format_desired.samples = TARGET_BUFFER_SIZE;
+	format_desired.samples = sound_config.buffer_size;
 	format_desired.callback = sdl_audio_callback;
 	format_desired.userdata = NULL;
 	assert(sizeof(float) == 4);
@@ -88,45 +105,333 @@ static bool sdl_audio_initialize()
 	sample_rate = format_obtained.freq;
 	buffer_size = format_obtained.samples;
 
-	// Finally enable output
-	SDL_PauseAudioDevice(audio_device, 0);
+	// The device stays paused until everything the callback uses has been set up for it
 	printf("[Sound] Using audio device %s\n", SDL_GetAudioDeviceName(audio_device, 0));
 	return true;
 }
 
+static void sdl_audio_start()
+{
+	if(audio_device) SDL_PauseAudioDevice(audio_device, 0);
+}
+
+static bool sdl_audio_initialize()
+{
+	// Initialize SDL audio subsystem if available
+	if(SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+	{
+		printf("[Sound] SDL audio unavailable: %s\n", SDL_GetError());
+		return false;
+	}
+
+	return sdl_audio_open();
+}
+
 static void sdl_audio_shutdown()
 {
-	// Close audio device
+	// Close audio device, once this returns the callback won't run again
 	if(audio_device) SDL_CloseAudioDevice(audio_device);
+	audio_device = 0;
+}
+
+static void sdl_audio_lock(bool lock)
+{
+	// Keeps the callback from running while its parameters change
+	if(!audio_device) return;
+	if(lock) SDL_LockAudioDevice(audio_device);
+	else SDL_UnlockAudioDevice(audio_device);
 }
 
 /* SDL-specific code end */
 
+/* Lockstep code start */
+
+// Sound is either synthesized on the audio thread whenever the device asks for more, or in lockstep on the
+// emulation thread, where it goes to a ring buffer that the device copies from, or to a file when offline
+static bool lockstep;
+static bool offline;
+static Timing::FuncHandle lockstep_func;
+static Timing::EventHandle lockstep_ev;
+static int64_t lockstep_period;
+static int64_t lockstep_samples;
+
+static std::unique_ptr<Common::SPSCQueue<float>> device_ring;
+
+// Audio callback statistics, only written by the audio thread
+static Common::Histogram stat_callback_time;
+static Common::Histogram stat_buffered;
+static std::atomic<uint64_t> stat_underruns;
+static std::atomic<int> stat_sample_rate, stat_buffer_size;
+
+static std::ofstream wav_file;
+static uint32_t wav_data_size;
+
+static void write_le(std::ofstream& file, uint32_t value, int size)
+{
+	for(int i = 0; i < size; i++)
+	{
+		file.put((char)(value >> (i * 8)));
+	}
+}
+
+static void write_wav_header()
+{
+	// 16-bit stereo PCM, the sizes are filled in again when the file is closed
+	constexpr static int CHANNELS = 2;
+	constexpr static int BYTES_PER_SAMPLE = 2;
+	wav_file.seekp(0);
+	wav_file.write("RIFF", 4);
+	write_le(wav_file, 36 + wav_data_size, 4);
+	wav_file.write("WAVE", 4);
+	wav_file.write("fmt ", 4);
+	write_le(wav_file, 16, 4);
+	write_le(wav_file, 1, 2);
+	write_le(wav_file, CHANNELS, 2);
+	write_le(wav_file, sample_rate, 4);
+	write_le(wav_file, sample_rate * CHANNELS * BYTES_PER_SAMPLE, 4);
+	write_le(wav_file, CHANNELS * BYTES_PER_SAMPLE, 2);
+	write_le(wav_file, BYTES_PER_SAMPLE * 8, 2);
+	wav_file.write("data", 4);
+	write_le(wav_file, wav_data_size, 4);
+}
+
+static void write_wav_samples(const float* buffer, uint32_t count)
+{
+	for(uint32_t i = 0; i < count; i++)
+	{
+		int16_t sample = (int16_t)lrintf(std::clamp(buffer[i], -1.f, 1.f) * 32767.f);
+		write_le(wav_file, (uint16_t)sample, 2);
+	}
+	wav_data_size += count * 2;
+}
+
+static void lockstep_output(const float* buffer, uint32_t count)
+{
+	if(!offline)
+	{
+		// If the device has stopped taking samples, the ones that don't fit are lost
+		// While fast-forwarding, they would only pile up ahead of playback, so none are kept
+		if(!fast_forward) device_ring->write(buffer, count);
+	}
+	else
+	{
+		write_wav_samples(buffer, count);
+	}
+}
+
+static void render_to_now()
+{
+	// Synthesize everything up to the current point in emulated time
+	int64_t now = Timing::get_timestamp(Timing::CPU_TIMER) * sample_rate / Timing::F_CPU;
+	float buffer[LOCKSTEP_BLOCK_SIZE * 2];
+	while(lockstep_samples < now)
+	{
+		int frames = (int)std::min<int64_t>(now - lockstep_samples, LOCKSTEP_BLOCK_SIZE);
+		sound_engine->render_block(buffer, frames);
+		lockstep_output(buffer, frames * 2);
+		lockstep_samples += frames;
+	}
+}
+
+static void lockstep_render(uint64_t param, int cycles_late)
+{
+	lockstep_ev = Timing::add_event(lockstep_func, Timing::convert_cpu(lockstep_period), 0, Timing::CPU_TIMER);
+	render_to_now();
+}
+
+static void lockstep_configure(bool new_device)
+{
+	if(!offline && new_device)
+	{
+		// Leave room for the target latency plus a few frames of emulation on top
+		// Whatever was buffered for the previous device is dropped
+		size_t capacity = 1;
+		while(capacity < 4 * 2 * (size_t)target_latency) capacity <<= 1;
+		device_ring = std::make_unique<Common::SPSCQueue<float>>(capacity);
+	}
+
+	// Continue from the current point in emulated time at the current rate
+	lockstep_samples = Timing::get_timestamp(Timing::CPU_TIMER) * sample_rate / Timing::F_CPU;
+	lockstep_period = (int64_t)Timing::F_CPU * LOCKSTEP_BLOCK_SIZE / sample_rate;
+}
+
+static void lockstep_start()
+{
+	// Synthesis follows emulated time exactly, so there is nothing to retime or correct
+	sound_engine->set_rate_control(false);
+	if(!offline) printf("[Sound] Synthesizing on the emulation thread\n");
+
+	lockstep_configure(true);
+	lockstep_func = Timing::register_func("Sound::lockstep_render", lockstep_render, true);
+	lockstep_ev = Timing::add_event(lockstep_func, Timing::convert_cpu(lockstep_period), 0, Timing::CPU_TIMER);
+}
+
+static bool offline_initialize(Config::SoundInfo& info)
+{
+	sample_rate = info.sample_rate;
+	buffer_size = LOCKSTEP_BLOCK_SIZE;
+
+	wav_file.open(info.wav_file_path, std::ios::binary);
+	if(!wav_file.is_open())
+	{
+		printf("[Sound] Failed to open %s\n", info.wav_file_path.c_str());
+		return false;
+	}
+	wav_data_size = 0;
+	write_wav_header();
+
+	printf("[Sound] Rendering offline to %s\n", info.wav_file_path.c_str());
+	return true;
+}
+
+static void lockstep_shutdown()
+{
+	if(wav_file.is_open())
+	{
+		// Include everything up to the point where emulation stopped
+		render_to_now();
+		write_wav_header();
+		wav_file.close();
+	}
+	device_ring = nullptr;
+}
+
+/* Lockstep code end */
+
 static void timeref(uint64_t param, int cycles_late);
 
-void initialize(std::vector<uint8_t>& sound_rom)
+static void schedule_timeref(int64_t cycles)
+{
+	timeref_ev = Timing::add_event(timeref_func, Timing::convert_cpu(cycles), 0, Timing::CPU_TIMER);
+	timeref_due = Timing::get_timestamp(Timing::CPU_TIMER) + cycles;
+}
+
+static void update_output_parameters()
 {
+	// Nothing is ever generated ahead of the emulator when offline
+	// Otherwise the latency can't be below one buffer, as that much is always generated at once
+	if(offline) target_latency = buffer_size;
+	else target_latency = std::max(sample_rate * TARGET_LATENCY_MS / 1000, buffer_size + sample_rate / 100);
+
+	// The time reference only helps if it updates more often than the device asks for buffers
+	timeref_enable = !lockstep && sound_config.timeref_frequency > sample_rate / buffer_size;
+
+	stat_sample_rate = sample_rate;
+	stat_buffer_size = buffer_size;
+	last_callback = 0;
+}
+
+static LoopySound::LoopySoundConfig get_engine_config()
+{
+	LoopySound::LoopySoundConfig config;
+	config.out_rate = (float)sample_rate;
+	config.buffer_size = buffer_size;
+	config.target_latency = target_latency;
+	config.mix_level = sound_config.mix_level;
+	config.filter_enable = sound_config.filter_enable;
+	return config;
+}
+
+static void update_timeref_schedule()
+{
+	if(timeref_enable && !timeref_ev.is_valid())
+	{
+		printf("[Sound] Schedule timeref %d Hz\n", sound_config.timeref_frequency);
+		if(!timeref_func.is_valid()) timeref_func = Timing::register_func("Sound::timeref", timeref, true);
+		timeref(0, 0);
+	}
+	else if(!timeref_enable && timeref_ev.is_valid())
+	{
+		Timing::cancel_event(timeref_ev);
+		timeref_ev = Timing::EventHandle();
+	}
+}
+
+void initialize(std::vector<uint8_t>& sound_rom, Config::SoundInfo& info)
+{
+	sound_config = info;
+	offline = info.offline;
+	lockstep = info.lockstep || offline;
+	suspended = false;
+	fast_forward = false;
+	rewinding = false;
 	if(!sound_rom.empty())
 	{
-		if(!sdl_audio_initialize())
+		if(offline)
 		{
-			return;
+			if(!offline_initialize(info))
+			{
+				return;
+			}
 		}
+		else
+		{
+			if(!sdl_audio_initialize())
+			{
+				return;
+			}
+		}
+		update_output_parameters();
 
-		sound_engine = std::make_unique<LoopySound::LoopySound>(sound_rom, (float)sample_rate, buffer_size);
+		sound_engine = std::make_unique<LoopySound::LoopySound>(sound_rom, get_engine_config());
 
-		if(TIMEREF_ENABLE)
+		if(lockstep)
+		{
+			lockstep_start();
+		}
+		else
 		{
-			printf("[Sound] Schedule timeref %d Hz\n", TIMEREF_FREQUENCY);
-			timeref_func = Timing::register_func("Sound::timeref", timeref);
-			timeref(0, 0);
+			update_timeref_schedule();
 		}
+
+		if(!offline) sdl_audio_start();
+	}
+}
+
+void reconfigure(Config::SoundInfo& info)
+{
+	if(!sound_engine) return;
+
+	// Lockstep output up to now belongs to the old parameters
+	if(lockstep) render_to_now();
+
+	// The device is only reopened if its format changes, otherwise the callback is just held off
+	bool new_device = !offline && (info.sample_rate != sound_config.sample_rate || info.buffer_size != sound_config.buffer_size);
+	if(new_device) sdl_audio_shutdown();
+	else sdl_audio_lock(true);
+
+	// The mode can't change while running, and neither can the format of a file that is being written
+	Config::SoundInfo old_config = sound_config;
+	sound_config = info;
+	sound_config.lockstep = old_config.lockstep;
+	sound_config.offline = old_config.offline;
+	sound_config.wav_file_path = old_config.wav_file_path;
+	if(offline) sound_config.sample_rate = old_config.sample_rate;
+
+	if(new_device && !sdl_audio_open())
+	{
+		printf("[Sound] Continuing without an audio device\n");
+	}
+	update_output_parameters();
+	sound_engine->reconfigure(get_engine_config());
+
+	if(lockstep)
+	{
+		lockstep_configure(new_device);
+	}
+	else
+	{
+		update_timeref_schedule();
 	}
+
+	if(new_device) sdl_audio_start();
+	else sdl_audio_lock(false);
 }
 
 void shutdown()
 {
-	sdl_audio_shutdown();
+	if(!offline) sdl_audio_shutdown();
+	if(lockstep && sound_engine) lockstep_shutdown();
 	sound_engine = nullptr;
 }
 
@@ -158,9 +463,17 @@ void ctrl_write16(uint32_t addr, uint16_t value)
 	value &= 0xFFF;
 	//printf("[Sound] Control register %03X\n", value);
 	//fflush(stdout);
-	if(sound_engine)
+	if(sound_engine && !suspended)
 	{
+		// In lockstep, the write takes effect on exactly the sample it happens at
+		// While fast-forwarding, playback is so far behind that retimed writes would overflow the queue, so they're applied right away
+		bool apply_now = fast_forward && !lockstep;
+		if(lockstep) render_to_now();
+		if(apply_now) sdl_audio_lock(true);
 		sound_engine->set_control_register(value);
+		if(lockstep) sound_engine->apply_queued_events();
+		if(apply_now) sound_engine->flush_queued_events();
+		if(apply_now) sdl_audio_lock(false);
 	}
 }
 
@@ -173,9 +486,96 @@ void midi_byte_in(uint8_t value)
 {
 	//printf("[Sound] MIDI byte %02X\n", value);
 	//fflush(stdout);
-	if(sound_engine)
+	if(sound_engine && !suspended)
 	{
+		bool apply_now = fast_forward && !lockstep;
+		if(lockstep) render_to_now();
+		if(apply_now) sdl_audio_lock(true);
 		sound_engine->midi_in((char)value);
+		if(lockstep) sound_engine->apply_queued_events();
+		if(apply_now) sound_engine->flush_queued_events();
+		if(apply_now) sdl_audio_lock(false);
+	}
+}
+
+// Schedules the pacing events again from the current point in emulated time
+// The time reference can keep its phase if emulated time is back where it was when the event was scheduled
+static void restart_pacing(bool keep_timeref_phase)
+{
+	if(lockstep)
+	{
+		lockstep_configure(false);
+		lockstep_ev = Timing::add_event(lockstep_func, Timing::convert_cpu(lockstep_period), 0, Timing::CPU_TIMER);
+	}
+	else if(timeref_enable)
+	{
+		int64_t delay = Timing::F_CPU / sound_config.timeref_frequency;
+		if(keep_timeref_phase) delay = std::max<int64_t>(timeref_due - Timing::get_timestamp(Timing::CPU_TIMER), 0);
+		schedule_timeref(delay);
+	}
+}
+
+void save_state(Common::StateWriter& writer)
+{
+	// While suspended, the synth isn't part of what is being saved, and is left alone when loading
+	bool has_engine = sound_engine && !suspended;
+	writer.begin_section("SND ");
+	writer.write<uint8_t>(has_engine);
+	if(has_engine)
+	{
+		// In lockstep, the synth is brought up to the current point in emulated time, where it continues after loading
+		if(lockstep) render_to_now();
+		else sdl_audio_lock(true);
+		sound_engine->save_state(writer);
+		if(!lockstep) sdl_audio_lock(false);
+	}
+	writer.end_section();
+}
+
+void load_state(Common::StateReader& reader)
+{
+	if(!reader.begin_section("SND ")) return;
+
+	// A state saved without sound loads, and so does one with sound when there's none now
+	bool saved_engine = reader.read<uint8_t>();
+	if(saved_engine && sound_engine && !suspended)
+	{
+		if(!lockstep) sdl_audio_lock(true);
+		sound_engine->load_state(reader);
+		if(!lockstep) sdl_audio_lock(false);
+	}
+	else
+	{
+		reader.skip_section();
+	}
+	reader.end_section();
+
+	// The scheduler dropped the pacing events, as they aren't part of the state
+	// While suspended, they are scheduled again on resuming
+	if(sound_engine && !suspended) restart_pacing(false);
+}
+
+void set_suspended(bool suspend)
+{
+	if(!sound_engine || suspend == suspended) return;
+	suspended = suspend;
+
+	if(!suspend)
+	{
+		// Emulated time is normally back where it was when suspending
+		restart_pacing(true);
+		return;
+	}
+
+	// Emulated time may go back before resuming, so pacing stops here and starts over from wherever it is then
+	if(lockstep)
+	{
+		render_to_now();
+		Timing::cancel_event(lockstep_ev);
+	}
+	else if(timeref_ev.is_valid())
+	{
+		Timing::cancel_event(timeref_ev);
 	}
 }
 
@@ -185,28 +585,110 @@ void set_mute(bool mute_in)
 	printf("[Sound] %s output\n", mute_in ? "Muted" : "Unmuted");
 }
 
+void set_fast_forward(bool enable)
+{
+	if(!sound_engine || offline || enable == fast_forward) return;
+	fast_forward = enable;
+
+	// Rate control would only chase the time reference, which stays at the playback position meanwhile
+	if(!lockstep)
+	{
+		sdl_audio_lock(true);
+		sound_engine->set_rate_control(!enable);
+		sdl_audio_lock(false);
+	}
+}
+
+void set_rewinding(bool enable)
+{
+	rewinding = enable;
+}
+
+static uint32_t get_time_us()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+static void sleep_precise(std::chrono::microseconds duration)
+{
+	// Sleeping can overshoot by a millisecond or more, so only sleep for most of it and spin for the rest
+	constexpr static auto SPIN_TIME = std::chrono::milliseconds(1);
+	auto end = std::chrono::steady_clock::now() + duration;
+	if(duration > SPIN_TIME) std::this_thread::sleep_for(duration - SPIN_TIME);
+	while(std::chrono::steady_clock::now() < end) std::this_thread::yield();
+}
+
+AudioStats get_audio_stats()
+{
+	AudioStats stats = {};
+	if(!sound_engine) return stats;
+
+	stats.callback_time_us = stat_callback_time.snapshot();
+	stats.buffered_samples = stat_buffered.snapshot();
+	stats.underruns = stat_underruns.load(std::memory_order_relaxed);
+
+	LoopySound::LoopySoundStats engine = sound_engine->get_stats();
+	stats.midi_queue_depth = engine.midi_queue_depth;
+	stats.midi_lateness = engine.midi_lateness;
+	stats.midi_overflows = engine.midi_overflows;
+	stats.time_corrections = engine.time_corrections;
+	stats.rate_ratio = engine.rate_ratio;
+	stats.sample_rate = stat_sample_rate;
+	stats.buffer_size = stat_buffer_size;
+	return stats;
+}
+
+bool wait_for_audio()
+{
+	if(!sound_engine || offline || (!lockstep && !timeref_enable)) return false;
+
+	while(true)
+	{
+		uint64_t callback = last_callback;
+		if(!callback) return false;
+
+		// Estimate how far the device has played since it last asked for samples
+		// If it hasn't asked for a while, it has stopped, and the emulator shouldn't wait for it
+		uint32_t elapsed_us = get_time_us() - (uint32_t)callback;
+		int64_t elapsed_samples = (int64_t)elapsed_us * sample_rate / 1000000;
+		if(elapsed_samples > 4 * buffer_size) return false;
+		int play_position = (int)(callback >> 32) + (int)std::min<int64_t>(elapsed_samples, buffer_size);
+
+		// In lockstep, everything in the ring is still to be played, otherwise it's whatever the emulator is ahead by
+		int buffered = lockstep ? (int)(device_ring->size() / 2) : sound_engine->get_time_reference() - play_position;
+		int excess = buffered - target_latency;
+		if(excess <= 0) return true;
+
+		// Wait at least a little, in case the device is late and the estimate can't move
+		int64_t wait_us = std::max<int64_t>((int64_t)excess * 1000000 / sample_rate, 500);
+		sleep_precise(std::chrono::microseconds(wait_us));
+	}
+}
+
 static void timeref(uint64_t param, int cycles_late)
 {
-	constexpr static int cycles_per_timeref = Timing::F_CPU / TIMEREF_FREQUENCY;
-	Timing::UnitCycle timeref_cycles = Timing::convert_cpu(cycles_per_timeref - cycles_late);
-	timeref_ev = Timing::add_event(timeref_func, timeref_cycles, 0, Timing::CPU_TIMER);
+	int cycles_per_timeref = Timing::F_CPU / sound_config.timeref_frequency;
+	schedule_timeref(cycles_per_timeref - cycles_late);
 
-	constexpr static float timeref_period = 1.f / TIMEREF_FREQUENCY;
+	// While fast-forwarding, the time reference only keeps up with playback, as MIDI doesn't wait for it
+	float timeref_period = fast_forward ? 0.f : 1.f / sound_config.timeref_frequency;
 	sound_engine->time_reference(timeref_period);
 }
 
 static void update_volume_level()
 {
-	if(MUTE_FADE_MS > 0)
+	bool muted = mute || fast_forward || rewinding;
+	if(sound_config.mute_fade_ms > 0)
 	{
-		float delta = 1000.f / (sample_rate * MUTE_FADE_MS);
-		if(mute) delta = -delta;
+		float delta = 1000.f / (sample_rate * sound_config.mute_fade_ms);
+		if(muted) delta = -delta;
 		volume_level += delta;
 		volume_level = std::clamp(volume_level, 0.f, 1.f);
 	}
 	else
 	{
-		volume_level = mute ? 0.f : 1.f;
+		volume_level = muted ? 0.f : 1.f;
 	}
 }
 
@@ -214,16 +696,38 @@ static void buffer_callback(float* sample_buffer, uint32_t sample_count)
 {
 	if(sound_engine)
 	{
-		// Generate samples if we can, updating the mute level every sample
-		float tmp[2];
-		int p = 0;
-		for(uint32_t i = 0; i < sample_count/2; i++)
+		// Let the emulator know where playback is, so that it can keep the right distance ahead
+		uint32_t played_samples = sound_engine->get_sample_count();
+		uint32_t start_us = get_time_us();
+		last_callback = ((uint64_t)played_samples << 32) | start_us;
+
+		// See how far ahead of playback the emulator was, it should have been at least this buffer ahead
+		uint32_t frames = sample_count/2;
+		if(lockstep || timeref_enable)
+		{
+			int buffered = lockstep ? (int)(device_ring->size() / 2) : sound_engine->get_time_reference() - (int)played_samples;
+			stat_buffered.add(std::max(buffered, 0));
+			if(buffered < (int)frames) stat_underruns.store(stat_underruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+
+		// Generate the whole buffer at once, then apply the mute level, updating it every sample
+		// In lockstep, the emulator has already generated it, if it fell behind the rest is silence
+		if(lockstep)
+		{
+			size_t copied = device_ring->read(sample_buffer, sample_count);
+			std::fill(sample_buffer + copied, sample_buffer + sample_count, 0.f);
+		}
+		else
+		{
+			sound_engine->render_block(sample_buffer, frames);
+		}
+		for(uint32_t i = 0; i < frames; i++)
 		{
 			update_volume_level();
-			sound_engine->gen_sample(tmp);
-			sample_buffer[p++] = tmp[0] * volume_level;
-			sample_buffer[p++] = tmp[1] * volume_level;
+			sample_buffer[i*2+0] *= volume_level;
+			sample_buffer[i*2+1] *= volume_level;
 		}
+		stat_callback_time.add(get_time_us() - start_us);
 	}
 	else
 	{
@@ -18,30 +18,40 @@ Game support notes:
 #pragma once
 #include <cstdint>
 #include <vector>
+#include <common/histogram.h>
+#include <core/config.h>
+
+namespace Common
+{
+class StateReader;
+class StateWriter;
+}
 
 namespace Sound
 {
 
-// Target output format. 44100-48000Hz provides good quality.
-// SDL converts unsupported formats internally.
-// Smaller buffer gives lower latency, larger buffer allows smoother timing with time reference.
-// A good compromise buffer size is around 50ms.
-constexpr static int TARGET_SAMPLE_RATE = 48000;
-constexpr static int TARGET_BUFFER_SIZE = 2048;
+// Output format, buffer size, time reference, mix level, filtering and mute fade are set at runtime through
+// Config::SoundInfo, where their defaults are.
 
-// Time reference to smooth out audio timing at larger buffer sizes. Assumes consistent CPU timing.
-constexpr static int TIMEREF_FREQUENCY = 100;
-constexpr static bool TIMEREF_ENABLE = TIMEREF_FREQUENCY > (TARGET_SAMPLE_RATE / TARGET_BUFFER_SIZE);
+// While sound is playing, the emulator waits for the audio device instead of a timer, keeping this much
+// audio buffered ahead of it. Must be longer than the buffer, or MIDI events arrive after they should play.
+// Clock drift between the two is corrected by the rate control in loopysound.h.
+constexpr static int TARGET_LATENCY_MS = 60;
 
-// Fade up/down time in milliseconds when sound is muted e.g. by minimizing the window.
-constexpr static int MUTE_FADE_MS = 20;
+// In lockstep mode, sound is synthesized on the emulation thread up to the current point in emulated time
+// before every MIDI byte or control register write, and at least every this many samples in between.
+constexpr static int LOCKSTEP_BLOCK_SIZE = 64;
 
 // Audio synthesis parameters in loopysound.h.
 
 
-void initialize(std::vector<uint8_t>& sound_rom);
+void initialize(std::vector<uint8_t>& sound_rom, Config::SoundInfo& info);
 void shutdown();
 
+// Applies new output parameters while running, reopening the audio device if needed. Call from the emulation thread.
+// Switching between lockstep, offline and callback modes requires restarting, and offline output keeps its sample rate.
+void reconfigure(Config::SoundInfo& info);
+
 constexpr static int CTRL_START = 0x04080000;
 constexpr static int CTRL_END = 0x040A0000;
 
@@ -55,4 +65,54 @@ void ctrl_write32(uint32_t addr, uint32_t value);
 void midi_byte_in(uint8_t value);
 void set_mute(bool mute_in);
 
+// While fast-forwarding, output is muted and MIDI plays as soon as it arrives instead of being retimed, as the emulator
+// runs ahead of playback. Has no effect when rendering offline. Call from the emulation thread.
+void set_fast_forward(bool enable);
+
+// Mutes output while rewinding, separately from set_mute. Call from the emulation thread.
+void set_rewinding(bool enable);
+
+// The synth and pending MIDI are part of save states, the output buffers and device aren't.
+// Loading keeps playing from the current output position. Call from the emulation thread, after Timing has loaded.
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
+// For frames that are thrown away again, e.g. by run-ahead: while suspended, MIDI and control writes are ignored,
+// synthesis doesn't follow emulated time, and save states leave the synth out. Call from the emulation thread.
+void set_suspended(bool suspend);
+
+// Sleeps until the audio device has caught up with the emulator, returns false if there is nothing to wait for.
+bool wait_for_audio();
+
+// Statistics of the audio pipeline since startup, for tuning the buffer size and latency per host.
+// Times are in microseconds and buffer levels in samples at the output rate. Safe to call from any thread.
+struct AudioStats
+{
+	int sample_rate, buffer_size;
+	Common::Histogram::Snapshot callback_time_us; // Time spent in each audio callback
+	Common::Histogram::Snapshot buffered_samples; // How far the emulator was ahead of playback at each callback
+	uint64_t underruns; // Callbacks that asked for more than the emulator was ahead by
+	Common::Histogram::Snapshot midi_queue_depth; // Queued MIDI bytes and control writes, sampled every 64 samples
+	Common::Histogram::Snapshot midi_lateness; // How many samples each MIDI byte played after its timestamp
+	uint64_t midi_overflows; // MIDI bytes dropped because the queue was full
+	Common::Histogram::Snapshot time_corrections; // Samples the time reference was moved by when it drifted too far
+	float rate_ratio; // Current playback speed set by the rate control
+
+	// Everything counted between an earlier call and this one
+	AudioStats operator-(const AudioStats& earlier) const
+	{
+		AudioStats result = *this;
+		result.callback_time_us = callback_time_us - earlier.callback_time_us;
+		result.buffered_samples = buffered_samples - earlier.buffered_samples;
+		result.underruns = underruns - earlier.underruns;
+		result.midi_queue_depth = midi_queue_depth - earlier.midi_queue_depth;
+		result.midi_lateness = midi_lateness - earlier.midi_lateness;
+		result.midi_overflows = midi_overflows - earlier.midi_overflows;
+		result.time_corrections = time_corrections - earlier.time_corrections;
+		return result;
+	}
+};
+
+AudioStats get_audio_stats();
+
 }
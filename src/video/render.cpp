@@ -1,7 +1,13 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <mutex>
+#include <thread>
 #include <common/bswp.h>
+#include <common/spsc_queue.h>
 #include "video/render.h"
 #include "video/vdp_local.h"
 
@@ -16,25 +22,40 @@ struct TilemapInfo
 	uint32_t data_start;
 };
 
-static uint16_t read_palette(uint8_t value)
+//Bitmap VRAM layouts selected by BM_CTRL
+template <int BITMAP_CTRL>
+struct BitmapLayout
 {
-	uint16_t color;
-	memcpy(&color, vdp.palette + (value * 2), 2);
-	return Common::bswp16(color);
-}
+	constexpr static bool is_8bit = BITMAP_CTRL != 0x04;
+
+	//If split_y is true, there are two separate maps at y=0 and y=256 that get scrolled independently
+	constexpr static bool split_y = BITMAP_CTRL == 0x00;
+
+	constexpr static int vram_width = is_8bit ? 256 : 512;
+	constexpr static int vram_height = split_y ? 256 : 512;
+	constexpr static int row_bytes = is_8bit ? vram_width : vram_width / 2;
+};
 
-static uint16_t read_screen(int index, int x)
+//Every drawer takes the VDP state it renders from, which is either the live state or the render thread's private copy
+typedef void (*LayerFunc)(VDP& vdp, int index, int y);
+typedef void (*ComposeFunc)(VDP& vdp, int y, const uint16_t* input_a, const uint16_t* input_b);
+
+//Layer and screen drawers specialized for the current VDP modes, selected once per scanline
+//A null entry means that the layer is disabled
+struct LineFuncs
 {
-	uint8_t pal_color = vdp.screens[index][x];
-	if (!pal_color || (index == 1 && vdp.color_prio.screen_b_backdrop_only))
-	{
-		return vdp.backdrops[index];
-	}
+	LayerFunc bg[2];
+	LayerFunc bitmap[4];
+	LayerFunc obj[2];
+	ComposeFunc compose;
+};
 
-	return read_palette(pal_color);
+static uint16_t read_palette(VDP& vdp, uint8_t value)
+{
+	return vdp.host_palette[value];
 }
 
-static void write_screen(int index, int x, uint8_t value)
+static void write_screen(VDP& vdp, int index, int x, uint8_t value)
 {
 	x &= 0x1FF;
 	if (x < DISPLAY_WIDTH)
@@ -43,10 +64,22 @@ static void write_screen(int index, int x, uint8_t value)
 	}
 }
 
-static void write_color(std::unique_ptr<uint16_t[]>& buffer, int x, int y, uint16_t value)
+template <int OUTPUT_MODE>
+static void write_screens(VDP& vdp, int x, uint8_t value)
 {
-	x &= 0x1FF;
+	if constexpr (OUTPUT_MODE & 0x1)
+	{
+		write_screen(vdp, 1, x, value);
+	}
+
+	if constexpr (OUTPUT_MODE & 0x2)
+	{
+		write_screen(vdp, 0, x, value);
+	}
+}
 
+static uint16_t* get_output_row(VDP& vdp, std::shared_ptr<uint16_t[]>& buffer, int y)
+{
 	//Layer output is always 240 lines long, even in 224-line mode
 	//This just centers the picture for 224-line mode
 	if (!vdp.mode.extra_scanlines)
@@ -54,19 +87,55 @@ static void write_color(std::unique_ptr<uint16_t[]>& buffer, int x, int y, uint1
 		y += 8;
 	}
 
-	if (x < DISPLAY_WIDTH)
+	return buffer.get() + (y * DISPLAY_WIDTH);
+}
+
+static uint8_t* get_display_row(VDP& vdp, int y)
+{
+	if (!vdp.mode.extra_scanlines)
+	{
+		y += 8;
+	}
+
+	return vdp.display_pixels + (y * vdp.display_pitch);
+}
+
+//Converts an ARGB1555 color to the display format
+template <DisplayFormat FORMAT>
+static void write_display_pixel(uint8_t* row, int x, uint16_t color)
+{
+	if constexpr (FORMAT == DisplayFormat::ARGB1555)
+	{
+		((uint16_t*)row)[x] = color;
+	}
+	else if constexpr (FORMAT == DisplayFormat::RGB565)
+	{
+		//Green gets its top bit copied into the extra low bit so that full intensity stays full
+		uint16_t g = (color >> 5) & 0x1F;
+		((uint16_t*)row)[x] = ((color & 0x7C00) << 1) | (g << 6) | ((g >> 4) << 5) | (color & 0x1F);
+	}
+	else
 	{
-		buffer[x + (y * DISPLAY_WIDTH)] = value;
+		uint32_t r = (color >> 10) & 0x1F;
+		uint32_t g = (color >> 5) & 0x1F;
+		uint32_t b = color & 0x1F;
+		r = (r << 3) | (r >> 2);
+		g = (g << 3) | (g >> 2);
+		b = (b << 3) | (b >> 2);
+		((uint32_t*)row)[x] = 0xFF000000 | (r << 16) | (g << 8) | b;
 	}
 }
 
-static void write_pal_color(std::unique_ptr<uint16_t[]>& buffer, int x, int y, uint8_t pal_index)
+static void write_pal_color(VDP& vdp, uint16_t* row, int x, uint8_t pal_index)
 {
-	uint16_t color = read_palette(pal_index);
-	write_color(buffer, x, y, color);
+	x &= 0x1FF;
+	if (x < DISPLAY_WIDTH)
+	{
+		row[x] = read_palette(vdp, pal_index);
+	}
 }
 
-static int get_bg_tile_size(int index)
+static int get_bg_tile_size(VDP& vdp, int index)
 {
 	int tile_size = (index == 0) ? vdp.bg_ctrl.tile_size0 : vdp.bg_ctrl.tile_size1;
 	switch (tile_size)
@@ -89,7 +158,7 @@ static int get_bg_tile_size(int index)
 	return tile_size;
 }
 
-static void get_tilemap_info(TilemapInfo& info)
+static void get_tilemap_info(VDP& vdp, TilemapInfo& info)
 {
 	switch (vdp.bg_ctrl.map_size)
 	{
@@ -125,26 +194,45 @@ static void get_tilemap_info(TilemapInfo& info)
 	}
 }
 
-static void draw_bg(int index, int screen_y)
+template <bool IS_8BIT>
+static uint8_t read_tile_pixel(VDP& vdp, uint32_t data_start, int tile_index, int tile_x, int tile_y)
 {
-	if (!vdp.layer_ctrl.bg_enable[index])
+	uint32_t offs = (tile_x & 0x7) + ((tile_y & 0x7) * 0x08) + (tile_index << 6);
+	if constexpr (IS_8BIT)
 	{
-		return;
+		return vdp.tile[(data_start + offs) & 0xFFFF];
+	}
+
+	offs >>= 1;
+	offs += vdp.tilebase << 9;
+	uint8_t tile_data = vdp.tile[(data_start + offs) & 0xFFFF];
+	if (tile_x & 0x1)
+	{
+		return tile_data & 0xF;
 	}
 
-	bool is_8bit = index == 0 && vdp.bg_ctrl.bg0_8bit;
-	int tile_size = get_bg_tile_size(index);
+	return tile_data >> 4;
+}
+
+template <bool IS_8BIT>
+static void draw_bg(VDP& vdp, int index, int screen_y)
+{
+	int tile_size = get_bg_tile_size(vdp, index);
 	int tile_size_mask = tile_size - 1;
 
 	TilemapInfo tilemap;
-	get_tilemap_info(tilemap);
+	get_tilemap_info(vdp, tilemap);
+
+	uint32_t map_start = (index == 1) ? tilemap.bg1_start : 0;
+	uint16_t palsel = vdp.bg_palsel[index];
+	uint16_t* layer_row = get_output_row(vdp, vdp.bg_output[index], screen_y);
 
-	uint32_t map_start = (index == 1) ? tilemap.bg1_start : 0;;
+	int x_mask = (tilemap.width * tile_size) - 1;
+	int y = (screen_y + vdp.bg_scrolly[index]) & ((tilemap.height * tile_size) - 1);
 
 	for (int screen_x = 0; screen_x < DISPLAY_WIDTH; screen_x++)
 	{
-		int x = (screen_x + vdp.bg_scrollx[index]) & ((tilemap.width * tile_size) - 1);
-		int y = (screen_y + vdp.bg_scrolly[index]) & ((tilemap.height * tile_size) - 1);
+		int x = (screen_x + vdp.bg_scrollx[index]) & x_mask;
 
 		uint16_t map_offs = (x / tile_size) + ((y / tile_size) * tilemap.width);
 
@@ -158,41 +246,14 @@ static void draw_bg(int index, int screen_y)
 		bool x_flip = (descriptor >> 14) & 0x1;
 		bool y_flip = descriptor >> 15;
 
-		int tile_x = x & tile_size_mask;
-		if (x_flip)
-		{
-			tile_x = tile_size_mask - tile_x;
-		}
-
-		int tile_y = y & tile_size_mask;
-		if (y_flip)
-		{
-			tile_y = tile_size_mask - tile_y;
-		}
+		//Flipping mirrors the coordinate within the tile, which is the same as inverting its bits
+		int tile_x = (x & tile_size_mask) ^ (x_flip ? tile_size_mask : 0);
+		int tile_y = (y & tile_size_mask) ^ (y_flip ? tile_size_mask : 0);
 
 		tile_index += tile_y & ~0x7;
 		tile_index += tile_x >> 3;
-		uint32_t offs = (tile_x & 0x7) + ((tile_y & 0x7) * 0x08) + (tile_index << 6);
 
-		uint8_t tile_data;
-		if (is_8bit)
-		{
-			tile_data = vdp.tile[(tilemap.data_start + offs) & 0xFFFF];
-		}
-		else
-		{
-			offs >>= 1;
-			offs += vdp.tilebase << 9;
-			tile_data = vdp.tile[(tilemap.data_start + offs) & 0xFFFF];
-			if (tile_x & 0x1)
-			{
-				tile_data &= 0xF;
-			}
-			else
-			{
-				tile_data >>= 4;
-			}
-		}
+		uint8_t tile_data = read_tile_pixel<IS_8BIT>(vdp, tilemap.data_start, tile_index, tile_x, tile_y);
 
 		//0 is transparent, no matter if it's 4-bit or 8-bit
 		if (!tile_data)
@@ -201,79 +262,160 @@ static void draw_bg(int index, int screen_y)
 		}
 
 		uint8_t output = tile_data;
-		if (!is_8bit)
+		if constexpr (!IS_8BIT)
 		{
-			uint16_t palsel = vdp.bg_palsel[index];
 			int pal = (palsel >> (pal_descriptor * 4)) & 0xF;
 			output |= pal << 4;
 		}
-		
-		write_pal_color(vdp.bg_output[index], screen_x, screen_y, output);
-		write_screen(screen_index, screen_x, output);
+
+		layer_row[screen_x] = read_palette(vdp, output);
+		vdp.screens[screen_index][screen_x] = output;
 	}
 }
 
-static void draw_bitmap(int index, int y)
+static void fetch_bitmap_row_8bit(VDP& vdp, uint8_t* dst, uint32_t row_addr, int data_x, int count, int width_mask)
 {
-	if (!vdp.layer_ctrl.bitmap_enable[index])
+	//The row can wrap around at most once since the display is never wider than the bitmap
+	int first_count = std::min(count, width_mask + 1 - data_x);
+	memcpy(dst, &vdp.bitmap[(row_addr + data_x) & 0x1FFFF], first_count);
+	memcpy(dst + first_count, &vdp.bitmap[row_addr & 0x1FFFF], count - first_count);
+}
+
+static void unpack_bitmap_nibbles(uint8_t* dst, const uint8_t* src, int data_x, int count)
+{
+	//The leftmost pixel of each byte is stored in the upper nibble
+	if (count && (data_x & 0x1))
 	{
-		return;
+		*dst++ = *src++ & 0xF;
+		count--;
+	}
+
+	for (int i = 0; i < (count >> 1); i++)
+	{
+		dst[i * 2] = src[i] >> 4;
+		dst[i * 2 + 1] = src[i] & 0xF;
+	}
+
+	if (count & 0x1)
+	{
+		dst[count - 1] = src[count >> 1] >> 4;
+	}
+}
+
+static void fetch_bitmap_row_4bit(VDP& vdp, uint8_t* dst, uint32_t row_addr, int data_x, int count, int width_mask)
+{
+	int first_count = std::min(count, width_mask + 1 - data_x);
+	unpack_bitmap_nibbles(dst, &vdp.bitmap[((row_addr + data_x) >> 1) & 0x1FFFF], data_x, first_count);
+	unpack_bitmap_nibbles(dst + first_count, &vdp.bitmap[(row_addr >> 1) & 0x1FFFF], 0, count - first_count);
+}
+
+template <int BITMAP_CTRL, int OUTPUT_MODE>
+static void draw_bitmap_pixel(VDP& vdp, uint16_t* layer_row, int x, uint8_t data, uint8_t pal_bits)
+{
+	using Layout = BitmapLayout<BITMAP_CTRL>;
+
+	uint8_t output = data;
+	if constexpr (!Layout::is_8bit)
+	{
+		output |= pal_bits;
 	}
 
+	write_pal_color(vdp, layer_row, x, output);
+	write_screens<OUTPUT_MODE>(vdp, x, output);
+}
+
+template <int BITMAP_CTRL, int OUTPUT_MODE>
+static void draw_bitmap_span(VDP& vdp, int index, uint16_t* layer_row, int start_x, int end_x, int data_y, uint8_t pal_bits)
+{
+	using Layout = BitmapLayout<BITMAP_CTRL>;
+
 	VDP::BitmapRegs* regs = &vdp.bitmap_regs[index];
 
-	if (y < regs->screeny || y > regs->screeny + regs->h)
+	//Pixels left of the clip boundary are never drawn, and only the first DISPLAY_WIDTH pixels are visible
+	start_x = std::max(start_x, (int)regs->clipx);
+	end_x = std::min(end_x, DISPLAY_WIDTH);
+	if (start_x >= end_x)
 	{
 		return;
 	}
 
-	int start_x = regs->screenx;
-	int end_x = (regs->screenx + regs->w + 1) & 0x1FF;
+	constexpr int width_mask = Layout::vram_width - 1;
+	int data_x = (regs->scrollx + start_x - regs->screenx) & width_mask;
+	int count = end_x - start_x;
 
-	bool is_8bit = false;
-	bool split_y = false;
-	int vram_width = 0, vram_height = 0;
-	switch (vdp.bitmap_ctrl)
+	//Fetch the whole span at once so that the pixel loop works on one palette index per byte
+	uint8_t row[DISPLAY_WIDTH];
+	uint32_t row_addr = data_y * Layout::vram_width;
+	if constexpr (Layout::is_8bit)
 	{
-	case 0x00:
-		is_8bit = true;
-		split_y = true;
-		vram_width = 256;
-		vram_height = 256;
-		break;
-	case 0x01:
-		is_8bit = true;
-		vram_width = 256;
-		vram_height = 512;
-		break;
-	case 0x04:
-		is_8bit = false;
-		vram_width = 512;
-		vram_height = 512;
-		break;
-	default:
-		assert(0);
+		fetch_bitmap_row_8bit(vdp, row, row_addr, data_x, count, width_mask);
+	}
+	else
+	{
+		fetch_bitmap_row_4bit(vdp, row, row_addr, data_x, count, width_mask);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (row[i])
+		{
+			draw_bitmap_pixel<BITMAP_CTRL, OUTPUT_MODE>(vdp, layer_row, start_x + i, row[i], pal_bits);
+		}
 	}
+}
 
-	int width_mask = vram_width - 1;
-	int height_mask = vram_height - 1;
+template <int BITMAP_CTRL>
+static int get_bitmap_data_y(const VDP::BitmapRegs* regs, int y)
+{
+	using Layout = BitmapLayout<BITMAP_CTRL>;
 
-	//The entire row needs to be looped rather than just the bitmap range because the buffer color is updated even outside the bitmap
-	//TODO: this could likely be optimized in the case where the buffer color is disabled (which is most of the time)
-	for (int x = 0; x < vram_width; x++)
+	int data_y = (regs->scrolly + y - regs->screeny) & (Layout::vram_height - 1);
+	if constexpr (Layout::split_y)
 	{
-		int data_x = (regs->scrollx + x - regs->screenx) & width_mask;
-		int data_y = (regs->scrolly + y - regs->screeny) & height_mask;
+		data_y |= regs->scrolly & 0x100;
+	}
+	return data_y;
+}
 
-		//If split_y is true, there are two separate maps at y=0 and y=256 that get scrolled independently
-		if (split_y)
+template <int BITMAP_CTRL, int OUTPUT_MODE>
+static void draw_bitmap(VDP& vdp, int index, int y)
+{
+	using Layout = BitmapLayout<BITMAP_CTRL>;
+
+	VDP::BitmapRegs* regs = &vdp.bitmap_regs[index];
+	uint16_t* layer_row = get_output_row(vdp, vdp.bitmap_output[index], y);
+	uint8_t pal_bits = ((vdp.bitmap_palsel >> ((3 - index) * 4)) & 0xF) << 4;
+
+	int start_x = regs->screenx;
+	int end_x = (regs->screenx + regs->w + 1) & 0x1FF;
+
+	constexpr int width_mask = Layout::vram_width - 1;
+	int data_y = get_bitmap_data_y<BITMAP_CTRL>(regs, y);
+
+	//Without the buffer color, only the visible part of the bitmap window needs to be drawn
+	if (!(regs->buffer_ctrl & 0x100))
+	{
+		if (end_x > start_x)
+		{
+			draw_bitmap_span<BITMAP_CTRL, OUTPUT_MODE>(vdp, index, layer_row, start_x, end_x, data_y, pal_bits);
+		}
+		else
 		{
-			data_y |= regs->scrolly & 0x100;
+			//The window wraps around the end of the line, so it's split into two spans
+			draw_bitmap_span<BITMAP_CTRL, OUTPUT_MODE>(vdp, index, layer_row, 0, end_x, data_y, pal_bits);
+			draw_bitmap_span<BITMAP_CTRL, OUTPUT_MODE>(vdp, index, layer_row, start_x, Layout::vram_width, data_y, pal_bits);
 		}
+		return;
+	}
+
+	//The entire row needs to be looped rather than just the bitmap range because the buffer color is updated even outside the bitmap
+	for (int x = 0; x < Layout::vram_width; x++)
+	{
+		int data_x = (regs->scrollx + x - regs->screenx) & width_mask;
 
-		uint32_t addr = data_x + (data_y * vram_width);
+		uint32_t addr = data_x + (data_y * Layout::vram_width);
 		uint8_t data;
-		if (is_8bit)
+		if constexpr (Layout::is_8bit)
 		{
 			data = vdp.bitmap[addr & 0x1FFFF];
 		}
@@ -291,21 +433,18 @@ static void draw_bitmap(int index, int y)
 			}
 		}
 
-		if (regs->buffer_ctrl & 0x100)
+		if (data == 0xFF)
 		{
-			if (data == 0xFF)
+			//HW bug: 0xFF fails to get replaced if x=0xFF
+			if (x != 0xFF)
 			{
-				//HW bug: 0xFF fails to get replaced if x=0xFF
-				if (x != 0xFF)
-				{
-					data = regs->buffered_color;
-				}
-			}
-			else if (data < (regs->buffer_ctrl & 0xFF))
-			{
-				regs->buffered_color = data;
+				data = regs->buffered_color;
 			}
 		}
+		else if (data < (regs->buffer_ctrl & 0xFF))
+		{
+			regs->buffered_color = data;
+		}
 
 		//Now that the buffer control logic has been processed, the pixel can actually be drawn appropriately
 		if (!data)
@@ -333,42 +472,63 @@ static void draw_bitmap(int index, int y)
 			}
 		}
 
-		uint8_t output = data;
-		if (!is_8bit)
+		draw_bitmap_pixel<BITMAP_CTRL, OUTPUT_MODE>(vdp, layer_row, x, data, pal_bits);
+	}
+}
+
+template <bool IS_8BIT, int OUTPUT_MODE, bool X_FLIP>
+static void draw_obj_row(VDP& vdp, int index, uint16_t* layer_row, uint32_t data_start, uint32_t descriptor, int start_x, int obj_width, int tile_y)
+{
+	uint16_t palsel = vdp.obj_palsel[index];
+	int pal_descriptor = (descriptor >> 12) & 0x3;
+	uint8_t pal_bits = ((palsel >> (pal_descriptor * 4)) & 0xF) << 4;
+
+	int tile_row_index = descriptor >> 24;
+	tile_row_index += tile_y & ~0x7;
+	tile_row_index += vdp.obj_ctrl.tile_index_offs[index] << 8;
+
+	for (int screen_x = start_x; screen_x < start_x + obj_width; screen_x++)
+	{
+		if ((screen_x & 0x1FF) >= DISPLAY_WIDTH)
 		{
-			int pal = (vdp.bitmap_palsel >> ((3 - index) * 4)) & 0xF;
-			output |= pal << 4;
+			continue;
 		}
 
-		int pair_index = index >> 1;
-		int output_mode = vdp.layer_ctrl.bitmap_screen_mode[pair_index];
+		int tile_x = (screen_x - start_x) & (obj_width - 1);
+		if constexpr (X_FLIP)
+		{
+			tile_x = obj_width - 1 - tile_x;
+		}
 
-		write_pal_color(vdp.bitmap_output[index], x, y, output);
+		int tile_index = tile_row_index + (tile_x >> 3);
+		uint8_t tile_data = read_tile_pixel<IS_8BIT>(vdp, data_start, tile_index, tile_x, tile_y);
 
-		if (output_mode & 0x1)
+		if (!tile_data)
 		{
-			write_screen(1, x, output);
+			continue;
 		}
 
-		if (output_mode & 0x2)
+		uint8_t output = tile_data;
+		if constexpr (!IS_8BIT)
 		{
-			write_screen(0, x, output);
+			output |= pal_bits;
 		}
+
+		write_pal_color(vdp, layer_row, screen_x, output);
+		write_screens<OUTPUT_MODE>(vdp, screen_x, output);
 	}
 }
 
-static void draw_obj(int index, int screen_y)
+template <bool IS_8BIT, int OUTPUT_MODE>
+static void draw_obj(VDP& vdp, int index, int screen_y)
 {
-	if (!vdp.layer_ctrl.obj_enable[index])
-	{
-		return;
-	}
-
 	//TODO: limit the maximum number of sprites per scanline
 
 	//Tilemap info is only useful here to get the start of tile data
 	TilemapInfo tilemap;
-	get_tilemap_info(tilemap);
+	get_tilemap_info(vdp, tilemap);
+
+	uint16_t* layer_row = get_output_row(vdp, vdp.obj_output[index], screen_y);
 
 	//OBJ #0 has highest priority, so the loop must be backwards
 	for (int id = OBJ_COUNT - 1; id >= 0; id--)
@@ -437,84 +597,64 @@ static void draw_obj(int index, int screen_y)
 
 		int start_x = descriptor & 0x1FF;
 
-		for (int screen_x = start_x; screen_x < start_x + obj_width; screen_x++)
-		{
-			if ((screen_x & 0x1FF) >= DISPLAY_WIDTH)
-			{
-				continue;
-			}
-
-			bool x_flip = (descriptor >> 14) & 0x1;
-			bool y_flip = (descriptor >> 15) & 0x1;
+		bool x_flip = (descriptor >> 14) & 0x1;
+		bool y_flip = (descriptor >> 15) & 0x1;
 
-			int tile_x = (screen_x - start_x) & (obj_width - 1);
-			if (x_flip)
-			{
-				tile_x = obj_width - 1 - tile_x;
-			}
+		int tile_y = (screen_y - start_y) & (obj_height - 1);
+		if (y_flip)
+		{
+			tile_y = obj_height - 1 - tile_y;
+		}
 
-			int tile_y = (screen_y - start_y) & (obj_height - 1);
-			if (y_flip)
-			{
-				tile_y = obj_height - 1 - tile_y;
-			}
+		if (x_flip)
+		{
+			draw_obj_row<IS_8BIT, OUTPUT_MODE, true>(vdp, index, layer_row, tilemap.data_start, descriptor, start_x, obj_width, tile_y);
+		}
+		else
+		{
+			draw_obj_row<IS_8BIT, OUTPUT_MODE, false>(vdp, index, layer_row, tilemap.data_start, descriptor, start_x, obj_width, tile_y);
+		}
+	}
+}
 
-			int tile_index = descriptor >> 24;
-			tile_index += tile_y & ~0x7;
-			tile_index += tile_x >> 3;
-			tile_index += vdp.obj_ctrl.tile_index_offs[index] << 8;
-			uint32_t offs = (tile_x & 0x7) + ((tile_y & 0x7) * 0x08) + (tile_index << 6);
+static bool is_bitmap_layer_visible(const VDP& vdp, int index, int y)
+{
+	if (!vdp.layer_ctrl.bitmap_enable[index])
+	{
+		return false;
+	}
 
-			uint8_t tile_data;
-			if (vdp.obj_ctrl.is_8bit)
-			{
-				tile_data = vdp.tile[(tilemap.data_start + offs) & 0xFFFF];
-			}
-			else
-			{
-				offs >>= 1;
-				offs += vdp.tilebase << 9;
-				tile_data = vdp.tile[(tilemap.data_start + offs) & 0xFFFF];
-				if (tile_x & 0x1)
-				{
-					tile_data &= 0xF;
-				}
-				else
-				{
-					tile_data >>= 4;
-				}
-			}
+	const VDP::BitmapRegs* regs = &vdp.bitmap_regs[index];
+	return y >= regs->screeny && y <= regs->screeny + regs->h;
+}
 
-			if (!tile_data)
-			{
-				continue;
-			}
+static void draw_bitmap_layer(VDP& vdp, const LineFuncs& funcs, int index, int y)
+{
+	if (!is_bitmap_layer_visible(vdp, index, y))
+	{
+		return;
+	}
 
-			uint8_t output = tile_data;
-			if (!vdp.obj_ctrl.is_8bit)
-			{
-				uint16_t palsel = vdp.obj_palsel[index];
-				int pal_descriptor = (descriptor >> 12) & 0x3;
-				int pal = (palsel >> (pal_descriptor * 4)) & 0xF;
-				output |= pal << 4;
-			}
+	//A missing drawer means BM_CTRL is set to an unknown mode
+	LayerFunc func = funcs.bitmap[index];
+	if (!func)
+	{
+		assert(0);
+		return;
+	}
 
-			write_pal_color(vdp.obj_output[index], screen_x, screen_y, output);
-			int output_mode = vdp.layer_ctrl.obj_screen_mode[index];
-			if (output_mode & 0x1)
-			{
-				write_screen(1, screen_x, output);
-			}
+	func(vdp, index, y);
+}
 
-			if (output_mode & 0x2)
-			{
-				write_screen(0, screen_x, output);
-			}
-		}
+static void draw_layer(VDP& vdp, LayerFunc func, int index, int y)
+{
+	if (func)
+	{
+		func(vdp, index, y);
 	}
 }
 
-static void draw_layers(int y)
+static void draw_layers(VDP& vdp, const LineFuncs& funcs, int y)
 {
 	//Draw each layer
 	//The order is important - each layer has a different priority, and lower priority layers are drawn first here
@@ -527,71 +667,63 @@ static void draw_layers(int y)
 
 	if (obj0_prio == 3)
 	{
-		draw_obj(0, y);
+		draw_layer(vdp, funcs.obj[0], 0, y);
 	}
 
-	draw_bg(1, y);
+	draw_layer(vdp, funcs.bg[1], 1, y);
 
 	if (!bg0_prio)
 	{
-		draw_bg(0, y);
+		draw_layer(vdp, funcs.bg[0], 0, y);
 	}
 
 	if (obj0_prio == 2)
 	{
-		draw_obj(0, y);
+		draw_layer(vdp, funcs.obj[0], 0, y);
 	}
 
-	draw_bitmap(bitmap_low + 1, y);
-	draw_bitmap(bitmap_low, y);
+	draw_bitmap_layer(vdp, funcs, bitmap_low + 1, y);
+	draw_bitmap_layer(vdp, funcs, bitmap_low, y);
 
 	if (obj0_prio == 1)
 	{
-		draw_obj(0, y);
+		draw_layer(vdp, funcs.obj[0], 0, y);
 	}
 
-	draw_bitmap(bitmap_hi + 1, y);
-	draw_bitmap(bitmap_hi, y);
+	draw_bitmap_layer(vdp, funcs, bitmap_hi + 1, y);
+	draw_bitmap_layer(vdp, funcs, bitmap_hi, y);
 
 	if (bg0_prio)
 	{
-		draw_bg(0, y);
+		draw_layer(vdp, funcs.bg[0], 0, y);
 	}
 
-	draw_obj(1, y);
+	draw_layer(vdp, funcs.obj[1], 1, y);
 
 	if (obj0_prio == 0)
 	{
-		draw_obj(0, y);
+		draw_layer(vdp, funcs.obj[0], 0, y);
 	}
 }
 
-static void draw_color_math(int y, bool half)
+template <DisplayFormat FORMAT, bool HALF, bool SUBTRACT>
+static void draw_color_math(VDP& vdp, int y, const uint16_t* input_a, const uint16_t* input_b)
 {
+	uint8_t* display_row = get_display_row(vdp, y);
+
 	for (int x = 0; x < DISPLAY_WIDTH; x++)
 	{
-		uint16_t input_a = 0, input_b = 0;
-		if (vdp.color_prio.output_screen_a)
-		{
-			input_a = read_screen(0, x);
-		}
-
-		if (vdp.color_prio.output_screen_b)
-		{
-			input_b = read_screen(1, x);
-		}
+		int a_r = (input_a[x] >> 10) & 0x1F;
+		int a_g = (input_a[x] >> 5) & 0x1F;
+		int a_b = input_a[x] & 0x1F;
 
-		int a_r = (input_a >> 10) & 0x1F;
-		int a_g = (input_a >> 5) & 0x1F;
-		int a_b = input_a & 0x1F;
-
-		int b_r = (input_b >> 10) & 0x1F;
-		int b_g = (input_b >> 5) & 0x1F;
-		int b_b = input_b & 0x1F;
+		int b_r = (input_b[x] >> 10) & 0x1F;
+		int b_g = (input_b[x] >> 5) & 0x1F;
+		int b_b = input_b[x] & 0x1F;
 
 		int out_r, out_g, out_b;
 
-		if (vdp.color_prio.blend_mode)
+		if constexpr (SUBTRACT)
 		{
 			//Subtractive blending
 			out_r = a_r - b_r;
@@ -606,7 +738,7 @@ static void draw_color_math(int y, bool half)
 			out_b = a_b + b_b;
 		}
 
-		if (half)
+		if constexpr (HALF)
 		{
 			out_r >>= 1;
 			out_g >>= 1;
@@ -617,104 +749,732 @@ static void draw_color_math(int y, bool half)
 		out_g = std::clamp(out_g, 0, 0x1F);
 		out_b = std::clamp(out_b, 0, 0x1F);
 
-		uint16_t output = (out_r << 10) | (out_g << 5) | out_b;
-		write_color(vdp.display_output, x, y, output);
+		write_display_pixel<FORMAT>(display_row, x, (out_r << 10) | (out_g << 5) | out_b);
 	}
 }
 
-static void draw_screen_overlay(int y, bool screen_b_prio)
+template <DisplayFormat FORMAT, bool SCREEN_B_PRIO>
+static void draw_screen_overlay(VDP& vdp, int y, const uint16_t* input_a, const uint16_t* input_b)
 {
+	uint8_t* display_row = get_display_row(vdp, y);
+
 	for (int x = 0; x < DISPLAY_WIDTH; x++)
 	{
-		uint16_t input_a = 0, input_b = 0;
-		if (vdp.color_prio.output_screen_a)
+		if constexpr (SCREEN_B_PRIO)
 		{
-			input_a = read_screen(0, x);
-		}
-
-		if (vdp.color_prio.output_screen_b)
-		{
-			input_b = read_screen(1, x);
-		}
-
-		uint16_t output = 0;
-		if (screen_b_prio)
-		{
-			output = input_a;
-
-			if (vdp.screens[1][x])
-			{
-				output = input_b;
-			}
+			write_display_pixel<FORMAT>(display_row, x, vdp.screens[1][x] ? input_b[x] : input_a[x]);
 		}
 		else
 		{
-			output = input_b;
-
-			if (vdp.screens[0][x])
-			{
-				output = input_a;
-			}
+			write_display_pixel<FORMAT>(display_row, x, vdp.screens[0][x] ? input_a[x] : input_b[x]);
 		}
-
-		write_color(vdp.display_output, x, y, output);
 	}
 }
 
-static void display_capture(int y)
+template <DisplayFormat FORMAT>
+static ComposeFunc get_compose_func(int dispmode, bool subtract)
 {
-	switch (vdp.capture_ctrl.format)
+	switch (dispmode)
 	{
-	case 0x03:
-		//Capture screen A before applying the palette
-		memcpy(vdp.capture_buffer, vdp.screens[0], DISPLAY_WIDTH * sizeof(uint8_t));
-		break;
+	case 0x00:
+		return subtract ? draw_color_math<FORMAT, false, true> : draw_color_math<FORMAT, false, false>;
+	case 0x01:
+		return subtract ? draw_color_math<FORMAT, true, true> : draw_color_math<FORMAT, true, false>;
+	case 0x04:
+		return draw_screen_overlay<FORMAT, true>;
+	case 0x05:
+		return draw_screen_overlay<FORMAT, false>;
 	default:
 		assert(0);
+		return nullptr;
 	}
 }
 
-void draw_scanline(int y)
+template <int BITMAP_CTRL>
+static LayerFunc get_bitmap_func(int output_mode)
 {
-	//Set both screens to the backdrop color
-	memset(vdp.screens, 0, sizeof(vdp.screens));
+	constexpr static LayerFunc funcs[4] =
+	{
+		draw_bitmap<BITMAP_CTRL, 0>,
+		draw_bitmap<BITMAP_CTRL, 1>,
+		draw_bitmap<BITMAP_CTRL, 2>,
+		draw_bitmap<BITMAP_CTRL, 3>
+	};
+	return funcs[output_mode & 0x3];
+}
 
-	draw_layers(y);
+template <bool IS_8BIT>
+static LayerFunc get_obj_func(int output_mode)
+{
+	constexpr static LayerFunc funcs[4] =
+	{
+		draw_obj<IS_8BIT, 0>,
+		draw_obj<IS_8BIT, 1>,
+		draw_obj<IS_8BIT, 2>,
+		draw_obj<IS_8BIT, 3>
+	};
+	return funcs[output_mode & 0x3];
+}
 
-	//Fetch the screen colors
-	for (int x = 0; x < DISPLAY_WIDTH; x++)
+static void select_line_funcs(VDP& vdp, LineFuncs& funcs)
+{
+	funcs = {};
+
+	for (int i = 0; i < 2; i++)
 	{
-		uint16_t color = read_screen(0, x);
-		write_color(vdp.screen_output[0], x, y, color);
+		if (vdp.layer_ctrl.bg_enable[i])
+		{
+			bool is_8bit = i == 0 && vdp.bg_ctrl.bg0_8bit;
+			funcs.bg[i] = is_8bit ? draw_bg<true> : draw_bg<false>;
+		}
 
-		color = read_screen(1, x);
-		write_color(vdp.screen_output[1], x, y, color);
+		if (vdp.layer_ctrl.obj_enable[i])
+		{
+			int output_mode = vdp.layer_ctrl.obj_screen_mode[i];
+			funcs.obj[i] = vdp.obj_ctrl.is_8bit ? get_obj_func<true>(output_mode) : get_obj_func<false>(output_mode);
+		}
 	}
 
-	//Draw the screens to the display output buffer
-	switch (vdp.dispmode)
+	//Unknown bitmap modes leave the drawers empty, which is only an error if a bitmap layer is actually drawn
+	for (int i = 0; i < 4; i++)
 	{
-	case 0x00:
-		draw_color_math(y, false);
+		int output_mode = vdp.layer_ctrl.bitmap_screen_mode[i >> 1];
+		switch (vdp.bitmap_ctrl)
+		{
+		case 0x00:
+			funcs.bitmap[i] = get_bitmap_func<0x00>(output_mode);
+			break;
+		case 0x01:
+			funcs.bitmap[i] = get_bitmap_func<0x01>(output_mode);
+			break;
+		case 0x04:
+			funcs.bitmap[i] = get_bitmap_func<0x04>(output_mode);
+			break;
+		}
+	}
+
+	bool subtract = vdp.color_prio.blend_mode;
+	switch (vdp.display_format)
+	{
+	case DisplayFormat::ARGB1555:
+		funcs.compose = get_compose_func<DisplayFormat::ARGB1555>(vdp.dispmode, subtract);
 		break;
-	case 0x01:
-		draw_color_math(y, true);
+	case DisplayFormat::RGB565:
+		funcs.compose = get_compose_func<DisplayFormat::RGB565>(vdp.dispmode, subtract);
 		break;
-	case 0x04:
-		draw_screen_overlay(y, true);
+	case DisplayFormat::ARGB8888:
+		funcs.compose = get_compose_func<DisplayFormat::ARGB8888>(vdp.dispmode, subtract);
 		break;
-	case 0x05:
-		draw_screen_overlay(y, false);
+	}
+}
+
+static void fetch_screen_colors(VDP& vdp, int index, uint16_t* colors)
+{
+	uint16_t backdrop = vdp.backdrops[index];
+	if (index == 1 && vdp.color_prio.screen_b_backdrop_only)
+	{
+		std::fill(colors, colors + DISPLAY_WIDTH, backdrop);
+		return;
+	}
+
+	for (int x = 0; x < DISPLAY_WIDTH; x++)
+	{
+		uint8_t pal_color = vdp.screens[index][x];
+		colors[x] = pal_color ? read_palette(vdp, pal_color) : backdrop;
+	}
+}
+
+static void display_capture(VDP& vdp, int y)
+{
+	switch (vdp.capture_ctrl.format)
+	{
+	case 0x03:
+		//Capture screen A before applying the palette
+		memcpy(vdp.capture_buffer, vdp.screens[0], DISPLAY_WIDTH * sizeof(uint8_t));
 		break;
 	default:
 		assert(0);
 	}
+}
+
+static void clear_output_row(VDP& vdp, std::shared_ptr<uint16_t[]>& buffer, int y)
+{
+	memset(get_output_row(vdp, buffer, y), 0, DISPLAY_WIDTH * sizeof(uint16_t));
+}
+
+static void clear_output_buffers(VDP& vdp)
+{
+	constexpr static int BUFFER_SIZE = DISPLAY_WIDTH * DISPLAY_HEIGHT * sizeof(uint16_t);
+
+	for (int i = 0; i < 2; i++)
+	{
+		memset(vdp.bg_output[i].get(), 0, BUFFER_SIZE);
+		memset(vdp.obj_output[i].get(), 0, BUFFER_SIZE);
+		memset(vdp.bitmap_output[i].get(), 0, BUFFER_SIZE);
+		memset(vdp.bitmap_output[i + 2].get(), 0, BUFFER_SIZE);
+		memset(vdp.screen_output[i].get(), 0, BUFFER_SIZE);
+	}
+
+	int row_size = DISPLAY_WIDTH * get_pixel_size(vdp.display_format);
+	for (int y = 0; y < DISPLAY_HEIGHT; y++)
+	{
+		memset(vdp.display_pixels + (y * vdp.display_pitch), 0, row_size);
+	}
+}
+
+//Line mode the output buffers were last drawn in, -1 if they haven't been drawn yet
+static int output_extra_scanlines;
+
+static void render_line(VDP& vdp, int y, bool capture_only)
+{
+	//Rows that aren't drawn in 224-line mode would otherwise keep showing lines from 240-line mode
+	if (vdp.mode.extra_scanlines != output_extra_scanlines)
+	{
+		clear_output_buffers(vdp);
+		output_extra_scanlines = vdp.mode.extra_scanlines;
+	}
+
+	LineFuncs funcs;
+	select_line_funcs(vdp, funcs);
+
+	//Set both screens to the backdrop color
+	memset(vdp.screens, 0, sizeof(vdp.screens));
+
+	//Layers only write their opaque pixels, so their rows must start out empty
+	for (int i = 0; i < 2; i++)
+	{
+		clear_output_row(vdp, vdp.bg_output[i], y);
+		clear_output_row(vdp, vdp.obj_output[i], y);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		clear_output_row(vdp, vdp.bitmap_output[i], y);
+	}
+
+	draw_layers(vdp, funcs, y);
+
+	//The display capture only needs the screens, so skip compositing the final image
+	if (capture_only)
+	{
+		display_capture(vdp, y);
+		vdp.capture_enable = false;
+		return;
+	}
+
+	//Fetch the screen colors
+	uint16_t screen_colors[2][DISPLAY_WIDTH];
+	for (int i = 0; i < 2; i++)
+	{
+		fetch_screen_colors(vdp, i, screen_colors[i]);
+		memcpy(get_output_row(vdp, vdp.screen_output[i], y), screen_colors[i], sizeof(screen_colors[i]));
+	}
+
+	//Draw the screens to the display output buffer
+	//Disabled screens contribute black to the output
+	static const uint16_t NO_INPUT[DISPLAY_WIDTH] = {};
+	const uint16_t* input_a = vdp.color_prio.output_screen_a ? screen_colors[0] : NO_INPUT;
+	const uint16_t* input_b = vdp.color_prio.output_screen_b ? screen_colors[1] : NO_INPUT;
+
+	if (funcs.compose)
+	{
+		funcs.compose(vdp, y, input_a, input_b);
+	}
 
 	if (vdp.capture_enable && y == vdp.capture_ctrl.scanline)
 	{
-		display_capture(y);
+		display_capture(vdp, y);
 		vdp.capture_enable = false;
 	}
 }
 
+//Every register the drawers read
+struct LineRegs
+{
+	VDP::Mode mode;
+	VDP::BitmapRegs bitmap_regs[4];
+	uint16_t bitmap_ctrl;
+	uint16_t bitmap_palsel;
+	VDP::BgCtrl bg_ctrl;
+	uint16_t bg_scrollx[2];
+	uint16_t bg_scrolly[2];
+	uint16_t bg_palsel[2];
+	uint16_t tilebase;
+	VDP::ObjCtrl obj_ctrl;
+	uint16_t obj_palsel[2];
+	uint16_t dispmode;
+	VDP::LayerCtrl layer_ctrl;
+	VDP::ColorPrio color_prio;
+	uint16_t backdrops[2];
+	VDP::CaptureCtrl capture_ctrl;
+	int capture_enable;
+};
+
+template <typename Dst, typename Src>
+static void copy_line_regs(Dst& dst, const Src& src)
+{
+	dst.mode = src.mode;
+
+	for (int i = 0; i < 4; i++)
+	{
+		//The buffered color is updated while drawing, so it belongs to whoever draws the lines
+		uint8_t buffered_color = dst.bitmap_regs[i].buffered_color;
+		dst.bitmap_regs[i] = src.bitmap_regs[i];
+		dst.bitmap_regs[i].buffered_color = buffered_color;
+	}
+
+	dst.bitmap_ctrl = src.bitmap_ctrl;
+	dst.bitmap_palsel = src.bitmap_palsel;
+	dst.bg_ctrl = src.bg_ctrl;
+	memcpy(dst.bg_scrollx, src.bg_scrollx, sizeof(dst.bg_scrollx));
+	memcpy(dst.bg_scrolly, src.bg_scrolly, sizeof(dst.bg_scrolly));
+	memcpy(dst.bg_palsel, src.bg_palsel, sizeof(dst.bg_palsel));
+	dst.tilebase = src.tilebase;
+	dst.obj_ctrl = src.obj_ctrl;
+	memcpy(dst.obj_palsel, src.obj_palsel, sizeof(dst.obj_palsel));
+	dst.dispmode = src.dispmode;
+	dst.layer_ctrl = src.layer_ctrl;
+	dst.color_prio = src.color_prio;
+	memcpy(dst.backdrops, src.backdrops, sizeof(dst.backdrops));
+	dst.capture_ctrl = src.capture_ctrl;
+	dst.capture_enable = src.capture_enable;
+}
+
+//Everything that a line's display output depends on
+//Tiles can come from anywhere in tile VRAM, but each bitmap layer reads a single page per line
+struct LineSignature
+{
+	LineRegs regs;
+	uint32_t tile_gen[TILE_VRAM_PAGES];
+	uint32_t bitmap_gen[4];
+	uint32_t oam_gen;
+	uint32_t palette_gen;
+};
+
+struct LineTracking
+{
+	//Signatures of the lines currently in the display output
+	LineSignature lines[DISPLAY_HEIGHT];
+	bool valid[DISPLAY_HEIGHT];
+
+	//Set when any line of the current frame was drawn
+	bool frame_changed;
+};
+
+static LineTracking tracking;
+
+template <int BITMAP_CTRL>
+static int get_bitmap_page(const VDP::BitmapRegs* regs, int y)
+{
+	using Layout = BitmapLayout<BITMAP_CTRL>;
+	return get_bitmap_data_y<BITMAP_CTRL>(regs, y) * Layout::row_bytes / VRAM_PAGE_SIZE;
+}
+
+//Returns false if the line depends on more than its signature and must always be drawn
+static bool get_line_signature(LineSignature& sig, int y)
+{
+	//Zero the padding too, signatures are compared with memcmp
+	memset(&sig, 0, sizeof(sig));
+
+	copy_line_regs(sig.regs, vdp);
+	memcpy(sig.tile_gen, vdp.mem_gen.tile, sizeof(sig.tile_gen));
+	sig.oam_gen = vdp.mem_gen.oam;
+	sig.palette_gen = vdp.mem_gen.palette;
+
+	//Capture lines are always drawn, so the capture state doesn't change what's on screen
+	sig.regs.capture_enable = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (!is_bitmap_layer_visible(vdp, i, y))
+		{
+			continue;
+		}
+
+		//The buffered color carries over from previous lines
+		const VDP::BitmapRegs* regs = &vdp.bitmap_regs[i];
+		if (regs->buffer_ctrl & 0x100)
+		{
+			return false;
+		}
+
+		int page;
+		switch (vdp.bitmap_ctrl)
+		{
+		case 0x00:
+			page = get_bitmap_page<0x00>(regs, y);
+			break;
+		case 0x01:
+			page = get_bitmap_page<0x01>(regs, y);
+			break;
+		case 0x04:
+			page = get_bitmap_page<0x04>(regs, y);
+			break;
+		default:
+			return false;
+		}
+
+		sig.bitmap_gen[i] = vdp.mem_gen.bitmap[page];
+	}
+
+	return true;
+}
+
+//Lines that have been queued but not yet drawn by the render thread
+constexpr static int LINE_QUEUE_SIZE = 256;
+
+//VRAM pages, OAM, and palette copies that haven't been applied to the render thread's VDP yet
+//Must be able to hold every page at once, as all of them can change before a single line
+constexpr static int PAGE_QUEUE_SIZE = 64;
+static_assert(PAGE_QUEUE_SIZE >= BITMAP_VRAM_PAGES + TILE_VRAM_PAGES + 2);
+
+struct LineSnapshot
+{
+	int y;
+	bool capture_only;
+
+	//Number of queued page updates that must be applied before this line is drawn
+	int page_count;
+
+	LineRegs regs;
+};
+
+struct PageUpdate
+{
+	uint8_t* dst;
+	int size;
+	uint8_t data[VRAM_PAGE_SIZE];
+};
+
+struct ThreadState
+{
+	std::thread thread;
+	std::atomic<bool> running;
+
+	Common::SPSCQueue<LineSnapshot> lines{LINE_QUEUE_SIZE};
+	Common::SPSCQueue<PageUpdate> pages{PAGE_QUEUE_SIZE};
+
+	//The render thread only sleeps when it runs out of lines
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	std::atomic<bool> sleeping;
+
+	uint64_t lines_queued;
+	std::atomic<uint64_t> lines_done;
+
+	//Set when a queued line performs a display capture that hasn't been copied back yet
+	bool capture_pending;
+	uint64_t capture_line;
+
+	//Memory versions that have been sent to the render thread
+	VDP::MemoryGen sent_gen;
+
+	//Private copy of the VDP that the render thread draws from
+	//Output buffers are shared with the live VDP
+	VDP vdp;
+};
+
+static std::unique_ptr<ThreadState> worker;
+
+template <typename T>
+static T* wait_for_slot(Common::SPSCQueue<T>& queue)
+{
+	T* slot;
+	while (!(slot = queue.write_slot()))
+	{
+		std::this_thread::yield();
+	}
+	return slot;
+}
+
+static void queue_page(uint8_t* dst, const uint8_t* src, int size)
+{
+	PageUpdate* page = wait_for_slot(worker->pages);
+	page->dst = dst;
+	page->size = size;
+	memcpy(page->data, src, size);
+	worker->pages.commit_write();
+}
+
+static int queue_changed_pages()
+{
+	int count = 0;
+	VDP::MemoryGen& sent = worker->sent_gen;
+
+	for (int i = 0; i < BITMAP_VRAM_PAGES; i++)
+	{
+		if (sent.bitmap[i] != vdp.mem_gen.bitmap[i])
+		{
+			uint32_t offs = i * VRAM_PAGE_SIZE;
+			queue_page(worker->vdp.bitmap + offs, vdp.bitmap + offs, VRAM_PAGE_SIZE);
+			count++;
+		}
+	}
+
+	for (int i = 0; i < TILE_VRAM_PAGES; i++)
+	{
+		if (sent.tile[i] != vdp.mem_gen.tile[i])
+		{
+			uint32_t offs = i * VRAM_PAGE_SIZE;
+			queue_page(worker->vdp.tile + offs, vdp.tile + offs, VRAM_PAGE_SIZE);
+			count++;
+		}
+	}
+
+	if (sent.oam != vdp.mem_gen.oam)
+	{
+		queue_page(worker->vdp.oam, vdp.oam, OAM_SIZE);
+		count++;
+	}
+
+	//Only the host palette is ever read by the drawers
+	if (sent.palette != vdp.mem_gen.palette)
+	{
+		queue_page((uint8_t*)worker->vdp.host_palette, (uint8_t*)vdp.host_palette, sizeof(vdp.host_palette));
+		count++;
+	}
+
+	sent = vdp.mem_gen;
+	return count;
+}
+
+static void queue_scanline(int y, bool capture_only)
+{
+	int page_count = queue_changed_pages();
+
+	LineSnapshot* line = wait_for_slot(worker->lines);
+	line->y = y;
+	line->capture_only = capture_only;
+	line->page_count = page_count;
+	copy_line_regs(line->regs, vdp);
+
+	//The capture is consumed as soon as the line is queued, the CPU reads the result through sync_capture()
+	if (vdp.capture_enable && y == vdp.capture_ctrl.scanline)
+	{
+		vdp.capture_enable = false;
+		worker->capture_pending = true;
+		worker->capture_line = worker->lines_queued + 1;
+	}
+
+	worker->lines.commit_write();
+	worker->lines_queued++;
+
+	//Pairs with the render thread setting sleeping before it checks for lines
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (worker->sleeping.load())
+	{
+		std::lock_guard<std::mutex> lock(worker->wake_mutex);
+		worker->wake.notify_one();
+	}
+}
+
+static void render_thread_main()
+{
+	while (true)
+	{
+		LineSnapshot* line = worker->lines.read_slot();
+		if (!line)
+		{
+			std::unique_lock<std::mutex> lock(worker->wake_mutex);
+			worker->sleeping = true;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			worker->wake.wait(lock, [] { return !worker->lines.empty() || !worker->running; });
+			worker->sleeping = false;
+
+			if (!worker->running)
+			{
+				return;
+			}
+			continue;
+		}
+
+		for (int i = 0; i < line->page_count; i++)
+		{
+			PageUpdate* page = worker->pages.read_slot();
+			assert(page);
+			memcpy(page->dst, page->data, page->size);
+			worker->pages.commit_read();
+		}
+
+		copy_line_regs(worker->vdp, line->regs);
+		render_line(worker->vdp, line->y, line->capture_only);
+
+		worker->lines.commit_read();
+		worker->lines_done.fetch_add(1, std::memory_order_release);
+	}
+}
+
+static void wait_for_lines(uint64_t count)
+{
+	while (worker->lines_done.load(std::memory_order_acquire) < count)
+	{
+		std::this_thread::yield();
+	}
+}
+
+static void submit_line(int y, bool capture_only)
+{
+	if (worker)
+	{
+		queue_scanline(y, capture_only);
+		return;
+	}
+
+	render_line(vdp, y, capture_only);
+}
+
+void initialize(bool threaded)
+{
+	output_extra_scanlines = -1;
+	memset(&tracking, 0, sizeof(tracking));
+
+	if (!threaded)
+	{
+		return;
+	}
+
+	worker = std::make_unique<ThreadState>();
+
+	//Start from the current state, everything that changes afterwards is sent with the lines
+	worker->vdp = vdp;
+	worker->sent_gen = vdp.mem_gen;
+
+	worker->running = true;
+	worker->sleeping = false;
+	worker->lines_queued = 0;
+	worker->lines_done = 0;
+	worker->capture_pending = false;
+	worker->capture_line = 0;
+	worker->thread = std::thread(render_thread_main);
+
+	printf("[Video] rendering on a separate thread\n");
+}
+
+void shutdown()
+{
+	if (!worker)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(worker->wake_mutex);
+		worker->running = false;
+		worker->wake.notify_one();
+	}
+
+	worker->thread.join();
+	worker = nullptr;
+}
+
+void start_frame()
+{
+	tracking.frame_changed = false;
+}
+
+bool frame_changed()
+{
+	return tracking.frame_changed;
+}
+
+void draw_scanline(int y)
+{
+	//Lines whose inputs haven't changed since the previous frame are already in the display output
+	//The display capture always has to be drawn, as the CPU can read it back
+	LineSignature sig;
+	bool trackable = get_line_signature(sig, y);
+	bool capture = vdp.capture_enable && y == vdp.capture_ctrl.scanline;
+	if (trackable && !capture && tracking.valid[y] && !memcmp(&sig, &tracking.lines[y], sizeof(sig)))
+	{
+		return;
+	}
+
+	memcpy(&tracking.lines[y], &sig, sizeof(sig));
+	tracking.valid[y] = trackable;
+	tracking.frame_changed = true;
+
+	submit_line(y, false);
+}
+
+void capture_scanline(int y)
+{
+	//The layer outputs of this line no longer match its signature
+	tracking.valid[y] = false;
+
+	submit_line(y, true);
+}
+
+void set_display_output(uint8_t* pixels, int pitch, DisplayFormat format)
+{
+	//Lines still being drawn must land in the old buffer
+	sync();
+
+	vdp.display_pixels = pixels;
+	vdp.display_pitch = pitch;
+	vdp.display_format = format;
+
+	if (worker)
+	{
+		worker->vdp.display_pixels = pixels;
+		worker->vdp.display_pitch = pitch;
+		worker->vdp.display_format = format;
+	}
+
+	//Nothing from previous frames is in the new buffer, clear it and redraw every line
+	output_extra_scanlines = -1;
+	memset(tracking.valid, 0, sizeof(tracking.valid));
+}
+
+void sync()
+{
+	if (!worker)
+	{
+		return;
+	}
+
+	wait_for_lines(worker->lines_queued);
+	sync_capture();
+}
+
+void sync_capture()
+{
+	if (!worker || !worker->capture_pending)
+	{
+		return;
+	}
+
+	wait_for_lines(worker->capture_line);
+	memcpy(vdp.capture_buffer, worker->vdp.capture_buffer, CAPTURE_SIZE);
+	worker->capture_pending = false;
+}
+
+void pull_buffered_colors()
+{
+	if (!worker)
+	{
+		return;
+	}
+
+	sync();
+	for (int i = 0; i < 4; i++)
+	{
+		vdp.bitmap_regs[i].buffered_color = worker->vdp.bitmap_regs[i].buffered_color;
+	}
+}
+
+void push_buffered_colors()
+{
+	if (!worker)
+	{
+		return;
+	}
+
+	//Once the render thread is idle, its VDP can be written until the next line is queued
+	sync();
+	for (int i = 0; i < 4; i++)
+	{
+		worker->vdp.bitmap_regs[i].buffered_color = vdp.bitmap_regs[i].buffered_color;
+	}
+}
+
 }
\ No newline at end of file
@@ -1,8 +1,36 @@
 #pragma once
+#include "video/video.h"
 
 namespace Video::Renderer
 {
 
+void initialize(bool threaded);
+void shutdown();
+
+void start_frame();
+
+//Whether any line of the display output was redrawn since the start of the frame
+bool frame_changed();
+
 void draw_scanline(int y);
 
+//Only draws what the display capture on this line needs, the display output is left untouched
+void capture_scanline(int y);
+
+//Switches the display output to a new buffer, which is fully redrawn on the next frame
+void set_display_output(uint8_t* pixels, int pitch, DisplayFormat format);
+
+//Waits until every queued line has been drawn, must be called before reading the output buffers
+void sync();
+
+//Waits for a pending display capture so that the CPU can read the capture buffer
+void sync_capture();
+
+//The bitmap layers' buffered colors change while lines are drawn, so only the render thread has the current ones
+//Waits for every queued line and copies them back to the live VDP, e.g. before saving a state
+void pull_buffered_colors();
+
+//Sends the live VDP's buffered colors to the render thread, e.g. after loading a state
+void push_buffered_colors();
+
 }
\ No newline at end of file
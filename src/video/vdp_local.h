@@ -5,14 +5,25 @@
 namespace Video
 {
 
+//Granularity of VRAM change tracking
+constexpr static int VRAM_PAGE_SIZE = 0x1000;
+constexpr static int BITMAP_VRAM_PAGES = BITMAP_VRAM_SIZE / VRAM_PAGE_SIZE;
+constexpr static int TILE_VRAM_PAGES = TILE_VRAM_SIZE / VRAM_PAGE_SIZE;
+
 struct VDP
 {
-	//16-bit color output of the layers, screens, and final image to be displayed
-	std::unique_ptr<uint16_t[]> bg_output[2];
-	std::unique_ptr<uint16_t[]> bitmap_output[4];
-	std::unique_ptr<uint16_t[]> obj_output[2];
-	std::unique_ptr<uint16_t[]> screen_output[2];
-	std::unique_ptr<uint16_t[]> display_output;
+	//16-bit color output of the layers and screens
+	//These are shared with the render thread's copy of the VDP
+	std::shared_ptr<uint16_t[]> bg_output[2];
+	std::shared_ptr<uint16_t[]> bitmap_output[4];
+	std::shared_ptr<uint16_t[]> obj_output[2];
+	std::shared_ptr<uint16_t[]> screen_output[2];
+
+	//Final image to be displayed, drawn either to display_buffer or to a buffer owned by the frontend
+	std::shared_ptr<uint8_t[]> display_buffer;
+	uint8_t* display_pixels;
+	int display_pitch;
+	DisplayFormat display_format;
 
 	int frame_ended;
 	int visible_scanlines; //Configured by VDP_MODE
@@ -32,9 +43,25 @@ struct VDP
 	//Palette - 0x0C051000
 	uint8_t palette[PALETTE_SIZE];
 
+	//Host-endian copy of the palette, updated on every palette write
+	//It stays ARGB1555 rather than the display format, as layer outputs, blending and display capture all work on its components
+	//Colors are only converted to the display format once a pixel is written out
+	uint16_t host_palette[PALETTE_SIZE / 2];
+
 	//Display capture buffer - 0x0C052000
 	uint8_t capture_buffer[CAPTURE_SIZE];
 
+	//Counts changes to the memory the renderer reads, so it can tell what changed since it last looked
+	struct MemoryGen
+	{
+		uint32_t bitmap[BITMAP_VRAM_PAGES];
+		uint32_t tile[TILE_VRAM_PAGES];
+		uint32_t oam;
+		uint32_t palette;
+	};
+
+	MemoryGen mem_gen;
+
 	//Control registers - 0x0C058xxx
 
 	struct Mode
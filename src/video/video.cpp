@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <limits>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <common/bswp.h>
+#include <common/state.h>
 #include <core/sh2/peripherals/sh2_intc.h>
 #include <core/memory.h>
 #include <core/timing.h>
@@ -19,7 +24,12 @@ static Timing::EventHandle vcount_ev, hsync_ev;
 
 VDP vdp;
 
-constexpr static int LINES_PER_FRAME = 263;
+static RenderMode render_mode;
+static int render_skip_frames;
+static int skip_counter;
+
+//Whether the current frame is drawn to the output buffers
+static bool render_frame;
 
 struct DumpHeader
 {
@@ -28,21 +38,24 @@ struct DumpHeader
 	uint32_t data_width;
 };
 
-static void dump_bmp(std::string name, std::unique_ptr<uint16_t[]>& data)
+static void dump_bmp(std::string name, const uint8_t* data, int pitch, DisplayFormat format)
 {
 	std::ofstream bmp_file(name + ".bmp", std::ios::binary);
 
 	const char* SIGNATURE = "BM";
 	bmp_file.write(SIGNATURE, 2);
 
-	constexpr static int DATA_SIZE = (DISPLAY_WIDTH * DISPLAY_HEIGHT * 2);
-	uint32_t file_size = DATA_SIZE + 0x36;
+	//RGB565 isn't a standard BMP format, so it needs the color masks spelled out after the header
+	bool bitfields = format == DisplayFormat::RGB565;
+	int row_size = DISPLAY_WIDTH * get_pixel_size(format);
+
+	uint32_t data_offs = 0x36 + (bitfields ? 12 : 0);
+	uint32_t file_size = (row_size * DISPLAY_HEIGHT) + data_offs;
 	bmp_file.write((char*)&file_size, 4);
 
 	uint32_t reserved = 0;
 	bmp_file.write((char*)&reserved, 4);
 
-	uint32_t data_offs = 0x36;
 	bmp_file.write((char*)&data_offs, 4);
 
 	uint32_t info_size = 0x28;
@@ -54,24 +67,41 @@ static void dump_bmp(std::string name, std::unique_ptr<uint16_t[]>& data)
 	uint16_t planes = 1;
 	bmp_file.write((char*)&planes, 2);
 
-	uint16_t bpp = 16;
+	uint16_t bpp = get_pixel_size(format) * 8;
 	bmp_file.write((char*)&bpp, 2);
 
-	uint32_t compression = 0;
-	bmp_file.write((char*)&compression, 4);
-	bmp_file.write((char*)&compression, 4);
-	bmp_file.write((char*)&compression, 4);
-	bmp_file.write((char*)&compression, 4);
-	bmp_file.write((char*)&compression, 4);
+	uint32_t compression = bitfields ? 3 : 0;
 	bmp_file.write((char*)&compression, 4);
 
+	uint32_t unused = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		bmp_file.write((char*)&unused, 4);
+	}
+
+	if (bitfields)
+	{
+		const uint32_t MASKS[] = {0xF800, 0x07E0, 0x001F};
+		bmp_file.write((char*)MASKS, sizeof(MASKS));
+	}
+
 	for (int y = 0; y < DISPLAY_HEIGHT; y++)
 	{
 		int flipped_y = DISPLAY_HEIGHT - y - 1;
-		bmp_file.write((char*)(data.get() + flipped_y * DISPLAY_WIDTH), DISPLAY_WIDTH * 2);
+		bmp_file.write((char*)(data + flipped_y * pitch), row_size);
 	}
 }
 
+static void dump_bmp(std::string name, std::shared_ptr<uint16_t[]>& data)
+{
+	dump_bmp(name, (uint8_t*)data.get(), DISPLAY_WIDTH * 2, DisplayFormat::ARGB1555);
+}
+
+static void dump_display_bmp()
+{
+	dump_bmp("output_display", vdp.display_pixels, vdp.display_pitch, vdp.display_format);
+}
+
 static void dump_all_bmps()
 {
 	for (int i = 0; i < 4; i++)
@@ -97,7 +127,7 @@ static void dump_all_bmps()
 		dump_bmp(obj_name + num, vdp.obj_output[i]);
 	}
 
-	dump_bmp("output_display", vdp.display_output);
+	dump_display_bmp();
 }
 
 static void start_hsync(uint64_t param, int cycles_late)
@@ -152,8 +182,12 @@ static void vsync_start()
 		SH2::OCPM::INTC::deassert_irq(irq_id);
 	}
 
-	dump_bmp("output_display", vdp.display_output);
-	//dump_all_bmps();
+	if (render_frame)
+	{
+		Renderer::sync();
+		dump_display_bmp();
+		//dump_all_bmps();
+	}
 	//dump_for_serial();
 }
 
@@ -163,7 +197,15 @@ static void inc_vcount(uint64_t param, int cycles_late)
 	vdp.hcount &= ~0x100;
 	if (vdp.vcount < vdp.visible_scanlines)
 	{
-		Renderer::draw_scanline(vdp.vcount);
+		if (render_frame)
+		{
+			Renderer::draw_scanline(vdp.vcount);
+		}
+		else if (vdp.capture_enable && vdp.vcount == vdp.capture_ctrl.scanline)
+		{
+			//The CPU can read back the display capture, so it still has to happen when the frame isn't drawn
+			Renderer::capture_scanline(vdp.vcount);
+		}
 	}
 
 	vdp.vcount++;
@@ -182,8 +224,6 @@ static void inc_vcount(uint64_t param, int cycles_late)
 		vdp.vcount = 0;
 	}
 
-	constexpr static int CYCLES_PER_FRAME = Timing::F_CPU / 60;
-	constexpr static int CYCLES_PER_LINE = CYCLES_PER_FRAME / LINES_PER_FRAME;
 	constexpr static int CYCLES_UNTIL_HSYNC = (CYCLES_PER_LINE * 256.0f) / 341.25f;
 
 	Timing::UnitCycle scanline_cycles = Timing::convert_cpu(CYCLES_PER_LINE - cycles_late);
@@ -193,6 +233,88 @@ static void inc_vcount(uint64_t param, int cycles_late)
 	hsync_ev = Timing::add_event(hsync_func, hsync_cycles, 0, Timing::CPU_TIMER);
 }
 
+static void update_host_palette(uint32_t addr, int size)
+{
+	//Palette writes can be unaligned bytes, so refresh every entry the write touched
+	addr &= 0x1FF;
+	int first = addr >> 1;
+	int last = std::min((int)(addr + size - 1) >> 1, (PALETTE_SIZE / 2) - 1);
+	for (int i = first; i <= last; i++)
+	{
+		uint16_t color;
+		memcpy(&color, &vdp.palette[i * 2], 2);
+		vdp.host_palette[i] = Common::bswp16(color);
+	}
+}
+
+//Only counts writes that change memory, as games often rewrite OAM and the palette with the same data every frame
+static bool write_tracked(uint8_t* dst, const void* src, int size, uint32_t& gen)
+{
+	if (!memcmp(dst, src, size))
+	{
+		return false;
+	}
+
+	memcpy(dst, src, size);
+	gen++;
+	return true;
+}
+
+static void fill_bitmap_lines(int first_line, int count)
+{
+	//Only the bits set in the mask are replaced
+	uint8_t mask = vdp.dma_mask & 0xFF;
+	uint8_t value = vdp.dma_value & mask;
+	if (!mask)
+	{
+		return;
+	}
+
+	uint8_t* data = &vdp.bitmap[first_line * DISPLAY_WIDTH];
+	int size = count * DISPLAY_WIDTH;
+
+	if (mask == 0xFF)
+	{
+		memset(data, value, size);
+	}
+	else
+	{
+#if defined(__SSE2__)
+		__m128i mask_vec = _mm_set1_epi8((char)mask);
+		__m128i value_vec = _mm_set1_epi8((char)value);
+		for (int i = 0; i < size; i += 16)
+		{
+			__m128i old_data = _mm_loadu_si128((__m128i*)(data + i));
+			__m128i new_data = _mm_or_si128(_mm_andnot_si128(mask_vec, old_data), value_vec);
+			_mm_storeu_si128((__m128i*)(data + i), new_data);
+		}
+#else
+		//Blend 8 pixels at once
+		uint64_t mask64 = 0x0101010101010101ULL * mask;
+		uint64_t value64 = 0x0101010101010101ULL * value;
+		for (int i = 0; i < size; i += 8)
+		{
+			uint64_t block;
+			memcpy(&block, data + i, 8);
+			block = (block & ~mask64) | value64;
+			memcpy(data + i, &block, 8);
+		}
+#endif
+	}
+
+	int first_page = (first_line * DISPLAY_WIDTH) / VRAM_PAGE_SIZE;
+	int last_page = ((first_line + count) * DISPLAY_WIDTH - 1) / VRAM_PAGE_SIZE;
+	for (int i = first_page; i <= last_page; i++)
+	{
+		vdp.mem_gen.bitmap[i]++;
+	}
+}
+
+static std::shared_ptr<uint16_t[]> alloc_output_buffer()
+{
+	return std::shared_ptr<uint16_t[]>(new uint16_t[DISPLAY_WIDTH * DISPLAY_HEIGHT]());
+}
+
 static void dump_serial_region(std::ofstream& dump, uint8_t* mem, uint32_t addr, uint32_t length)
 {
 	DumpHeader header;
@@ -204,18 +326,23 @@ static void dump_serial_region(std::ofstream& dump, uint8_t* mem, uint32_t addr,
 	dump.write((char*)mem, length);
 }
 
-void initialize()
+void initialize(Config::VideoInfo& info)
 {
 	vdp = {};
 
 	vdp.visible_scanlines = 0xE0;
 
+	render_mode = RenderMode::Full;
+	render_skip_frames = 0;
+	skip_counter = 0;
+	render_frame = true;
+
 	//Initialize output buffers
 	for (int i = 0; i < 2; i++)
 	{
-		vdp.bg_output[i] = std::make_unique<uint16_t[]>(DISPLAY_WIDTH * DISPLAY_HEIGHT);
-		vdp.obj_output[i] = std::make_unique<uint16_t[]>(DISPLAY_WIDTH * DISPLAY_HEIGHT);
-		vdp.screen_output[i] = std::make_unique<uint16_t[]>(DISPLAY_WIDTH * DISPLAY_HEIGHT);
+		vdp.bg_output[i] = alloc_output_buffer();
+		vdp.obj_output[i] = alloc_output_buffer();
+		vdp.screen_output[i] = alloc_output_buffer();
 	}
 
 	//Set all OBJs to invisible
@@ -226,16 +353,19 @@ void initialize()
 
 	for (int i = 0; i < 4; i++)
 	{
-		vdp.bitmap_output[i] = std::make_unique<uint16_t[]>(DISPLAY_WIDTH * DISPLAY_HEIGHT);
+		vdp.bitmap_output[i] = alloc_output_buffer();
 	}
 
-	vdp.display_output = std::make_unique<uint16_t[]>(DISPLAY_WIDTH * DISPLAY_HEIGHT);
+	set_display_output(DisplayFormat::ARGB1555);
 
-	//Map VRAM to the CPU
+	//Map VRAM to the CPU for reading, writes are handled by the VRAM MMIO accessors
 	//Bitmap VRAM is mirrored
-	Memory::map_sh2_pagetable(vdp.bitmap, BITMAP_VRAM_START, BITMAP_VRAM_SIZE);
-	Memory::map_sh2_pagetable(vdp.bitmap, BITMAP_VRAM_START + BITMAP_VRAM_SIZE, BITMAP_VRAM_SIZE);
-	Memory::map_sh2_pagetable(vdp.tile, TILE_VRAM_START, TILE_VRAM_SIZE);
+	Memory::map_sh2_read_pagetable(vdp.bitmap, BITMAP_VRAM_START, BITMAP_VRAM_SIZE);
+	Memory::map_sh2_read_pagetable(vdp.bitmap, BITMAP_VRAM_START + BITMAP_VRAM_SIZE, BITMAP_VRAM_SIZE);
+	Memory::map_sh2_read_pagetable(vdp.tile, TILE_VRAM_START, TILE_VRAM_SIZE);
+
+	//The renderer must be ready before the first scanline
+	Renderer::initialize(info.threaded_render);
 
 	vcount_func = Timing::register_func("Video::inc_vcount", inc_vcount);
 	hsync_func = Timing::register_func("Video::start_hsync", start_hsync);
@@ -246,26 +376,39 @@ void initialize()
 
 void shutdown()
 {
-	// nop
+	Renderer::shutdown();
 }
 
-void start_frame()
+void set_render_mode(RenderMode mode, int skip_frames)
 {
-	vdp.frame_ended = false;
+	render_mode = mode;
+	render_skip_frames = skip_frames;
+	skip_counter = 0;
+}
 
-	constexpr static int BUFFER_SIZE = DISPLAY_WIDTH * DISPLAY_HEIGHT;
+void start_frame(bool render)
+{
+	vdp.frame_ended = false;
 
-	//Clear the output buffers
-	for (int i = 0; i < 2; i++)
+	//Skipped frames keep showing the last drawn frame
+	switch (render ? render_mode : RenderMode::None)
 	{
-		memset(vdp.bg_output[i].get(), 0, BUFFER_SIZE);
-		memset(vdp.obj_output[i].get(), 0, BUFFER_SIZE);
-		memset(vdp.bitmap_output[i].get(), 0, BUFFER_SIZE);
-		memset(vdp.bitmap_output[i + 2].get(), 0, BUFFER_SIZE);
-		memset(vdp.screen_output[i].get(), 0, BUFFER_SIZE);
+	case RenderMode::Full:
+		render_frame = true;
+		break;
+	case RenderMode::Skip:
+		render_frame = skip_counter == 0;
+		skip_counter = (skip_counter + 1) % (render_skip_frames + 1);
+		break;
+	case RenderMode::None:
+		render_frame = false;
+		break;
+	default:
+		assert(0);
 	}
 
-	memset(vdp.display_output.get(), 0, BUFFER_SIZE);
+	//Output rows are cleared as they're drawn, so that unchanged lines can keep their previous contents
+	Renderer::start_frame();
 }
 
 bool check_frame_end()
@@ -273,9 +416,53 @@ bool check_frame_end()
 	return vdp.frame_ended;
 }
 
-uint16_t* get_display_output()
+bool display_changed()
 {
-	return vdp.display_output.get();
+	return Renderer::frame_changed();
+}
+
+int get_pixel_size(DisplayFormat format)
+{
+	switch (format)
+	{
+	case DisplayFormat::ARGB1555:
+	case DisplayFormat::RGB565:
+		return 2;
+	case DisplayFormat::ARGB8888:
+		return 4;
+	default:
+		assert(0);
+		return 0;
+	}
+}
+
+void set_display_output(DisplayFormat format, void* pixels, int pitch)
+{
+	if (!pixels)
+	{
+		pitch = DISPLAY_WIDTH * get_pixel_size(format);
+		vdp.display_buffer = std::shared_ptr<uint8_t[]>(new uint8_t[pitch * DISPLAY_HEIGHT]());
+		pixels = vdp.display_buffer.get();
+	}
+
+	Renderer::set_display_output((uint8_t*)pixels, pitch, format);
+
+	//The internal buffer is only kept while it's in use
+	if (pixels != vdp.display_buffer.get())
+	{
+		vdp.display_buffer = nullptr;
+	}
+}
+
+void* get_display_output()
+{
+	Renderer::sync();
+	return vdp.display_pixels;
+}
+
+int get_display_pitch()
+{
+	return vdp.display_pitch;
 }
 
 void dump_for_serial()
@@ -293,6 +480,202 @@ void dump_for_serial()
 	//TODO: dump MMIO
 }
 
+//Calls func on every field that goes into states, the same list is used for saving and loading
+template <typename Func>
+static void visit_state(Func func)
+{
+	func(vdp.frame_ended);
+	func(vdp.visible_scanlines);
+
+	func(vdp.bitmap);
+	func(vdp.tile);
+	func(vdp.oam);
+	func(vdp.palette);
+	func(vdp.capture_buffer);
+
+	func(vdp.mode);
+	func(vdp.hcount);
+	func(vdp.vcount);
+	func(vdp.sync_irq_ctrl);
+	func(vdp.capture_enable);
+
+	func(vdp.bitmap_regs);
+	func(vdp.bitmap_ctrl);
+	func(vdp.bitmap_palsel);
+
+	func(vdp.bg_ctrl);
+	func(vdp.bg_scrollx);
+	func(vdp.bg_scrolly);
+	func(vdp.bg_palsel);
+	func(vdp.tilebase);
+	func(vdp.obj_ctrl);
+	func(vdp.obj_palsel);
+
+	func(vdp.dispmode);
+	func(vdp.layer_ctrl);
+	func(vdp.color_prio);
+	func(vdp.backdrops);
+	func(vdp.capture_ctrl);
+
+	func(vdp.cmp_irq_ctrl);
+	func(vdp.irq0_hcmp);
+	func(vdp.irq0_vcmp);
+
+	func(vdp.dma_mask);
+	func(vdp.dma_value);
+}
+
+void save_state(Common::StateWriter& writer)
+{
+	//Lines still being drawn on the render thread haven't updated the capture buffer and buffered colors yet
+	//Waiting for them all brings both up to date
+	Renderer::pull_buffered_colors();
+
+	writer.begin_section("VDP ");
+	writer.write(vcount_ev);
+	writer.write(hsync_ev);
+	visit_state([&](auto& value) { writer.write(value); });
+	writer.end_section();
+}
+
+//Memory contents from before a state was loaded, to find what the state changed
+struct MemoryCopy
+{
+	uint8_t bitmap[BITMAP_VRAM_SIZE];
+	uint8_t tile[TILE_VRAM_SIZE];
+	uint8_t oam[OAM_SIZE];
+	uint8_t palette[PALETTE_SIZE];
+};
+
+static MemoryCopy pre_load;
+
+static void bump_if_changed(const uint8_t* old_data, const uint8_t* new_data, int size, uint32_t& gen)
+{
+	if (memcmp(old_data, new_data, size))
+	{
+		gen++;
+	}
+}
+
+void load_state(Common::StateReader& reader)
+{
+	//Nothing queued for the render thread may finish after the state is in place
+	Renderer::sync();
+
+	if (!reader.begin_section("VDP "))
+	{
+		return;
+	}
+
+	memcpy(pre_load.bitmap, vdp.bitmap, BITMAP_VRAM_SIZE);
+	memcpy(pre_load.tile, vdp.tile, TILE_VRAM_SIZE);
+	memcpy(pre_load.oam, vdp.oam, OAM_SIZE);
+	memcpy(pre_load.palette, vdp.palette, PALETTE_SIZE);
+
+	reader.read(vcount_ev);
+	reader.read(hsync_ev);
+	visit_state([&](auto& value) { reader.read(value); });
+	reader.end_section();
+
+	update_host_palette(0, PALETTE_SIZE);
+	Renderer::push_buffered_colors();
+
+	//Count every page that the state changed as written, so that the render thread gets a fresh copy and the lines using it are drawn again
+	//Loading a state that is mostly the same, e.g. for run-ahead, then only redraws what differs
+	for (int i = 0; i < BITMAP_VRAM_PAGES; i++)
+	{
+		uint32_t offs = i * VRAM_PAGE_SIZE;
+		bump_if_changed(pre_load.bitmap + offs, vdp.bitmap + offs, VRAM_PAGE_SIZE, vdp.mem_gen.bitmap[i]);
+	}
+
+	for (int i = 0; i < TILE_VRAM_PAGES; i++)
+	{
+		uint32_t offs = i * VRAM_PAGE_SIZE;
+		bump_if_changed(pre_load.tile + offs, vdp.tile + offs, VRAM_PAGE_SIZE, vdp.mem_gen.tile[i]);
+	}
+
+	bump_if_changed(pre_load.oam, vdp.oam, OAM_SIZE, vdp.mem_gen.oam);
+	bump_if_changed(pre_load.palette, vdp.palette, PALETTE_SIZE, vdp.mem_gen.palette);
+}
+
+uint8_t bitmap_read8(uint32_t addr)
+{
+	return vdp.bitmap[addr & 0x1FFFF];
+}
+
+uint16_t bitmap_read16(uint32_t addr)
+{
+	uint16_t value;
+	memcpy(&value, &vdp.bitmap[addr & 0x1FFFF], 2);
+	return Common::bswp16(value);
+}
+
+uint32_t bitmap_read32(uint32_t addr)
+{
+	uint32_t value;
+	memcpy(&value, &vdp.bitmap[addr & 0x1FFFF], 4);
+	return Common::bswp32(value);
+}
+
+void bitmap_write8(uint32_t addr, uint8_t value)
+{
+	addr &= 0x1FFFF;
+	write_tracked(&vdp.bitmap[addr], &value, 1, vdp.mem_gen.bitmap[addr / VRAM_PAGE_SIZE]);
+}
+
+void bitmap_write16(uint32_t addr, uint16_t value)
+{
+	addr &= 0x1FFFF;
+	value = Common::bswp16(value);
+	write_tracked(&vdp.bitmap[addr], &value, 2, vdp.mem_gen.bitmap[addr / VRAM_PAGE_SIZE]);
+}
+
+void bitmap_write32(uint32_t addr, uint32_t value)
+{
+	addr &= 0x1FFFF;
+	value = Common::bswp32(value);
+	write_tracked(&vdp.bitmap[addr], &value, 4, vdp.mem_gen.bitmap[addr / VRAM_PAGE_SIZE]);
+}
+
+uint8_t tile_read8(uint32_t addr)
+{
+	return vdp.tile[addr & 0xFFFF];
+}
+
+uint16_t tile_read16(uint32_t addr)
+{
+	uint16_t value;
+	memcpy(&value, &vdp.tile[addr & 0xFFFF], 2);
+	return Common::bswp16(value);
+}
+
+uint32_t tile_read32(uint32_t addr)
+{
+	uint32_t value;
+	memcpy(&value, &vdp.tile[addr & 0xFFFF], 4);
+	return Common::bswp32(value);
+}
+
+void tile_write8(uint32_t addr, uint8_t value)
+{
+	addr &= 0xFFFF;
+	write_tracked(&vdp.tile[addr], &value, 1, vdp.mem_gen.tile[addr / VRAM_PAGE_SIZE]);
+}
+
+void tile_write16(uint32_t addr, uint16_t value)
+{
+	addr &= 0xFFFF;
+	value = Common::bswp16(value);
+	write_tracked(&vdp.tile[addr], &value, 2, vdp.mem_gen.tile[addr / VRAM_PAGE_SIZE]);
+}
+
+void tile_write32(uint32_t addr, uint32_t value)
+{
+	addr &= 0xFFFF;
+	value = Common::bswp32(value);
+	write_tracked(&vdp.tile[addr], &value, 4, vdp.mem_gen.tile[addr / VRAM_PAGE_SIZE]);
+}
+
 uint8_t palette_read8(uint32_t addr)
 {
 	return vdp.palette[addr & 0x1FF];
@@ -314,19 +697,28 @@ uint32_t palette_read32(uint32_t addr)
 
 void palette_write8(uint32_t addr, uint8_t value)
 {
-	vdp.palette[addr & 0x1FF] = value;
+	if (write_tracked(&vdp.palette[addr & 0x1FF], &value, 1, vdp.mem_gen.palette))
+	{
+		update_host_palette(addr, 1);
+	}
 }
 
 void palette_write16(uint32_t addr, uint16_t value)
 {
 	value = Common::bswp16(value);
-	memcpy(&vdp.palette[addr & 0x1FF], &value, 2);
+	if (write_tracked(&vdp.palette[addr & 0x1FF], &value, 2, vdp.mem_gen.palette))
+	{
+		update_host_palette(addr, 2);
+	}
 }
 
 void palette_write32(uint32_t addr, uint32_t value)
 {
 	value = Common::bswp32(value);
-	memcpy(&vdp.palette[addr & 0x1FF], &value, 4);
+	if (write_tracked(&vdp.palette[addr & 0x1FF], &value, 4, vdp.mem_gen.palette))
+	{
+		update_host_palette(addr, 4);
+	}
 }
 
 uint8_t oam_read8(uint32_t addr)
@@ -357,13 +749,13 @@ void oam_write8(uint32_t addr, uint8_t value)
 void oam_write16(uint32_t addr, uint16_t value)
 {
 	value = Common::bswp16(value);
-	memcpy(&vdp.oam[addr & 0x1FF], &value, 2);
+	write_tracked(&vdp.oam[addr & 0x1FF], &value, 2, vdp.mem_gen.oam);
 }
 
 void oam_write32(uint32_t addr, uint32_t value)
 {
 	value = Common::bswp32(value);
-	memcpy(&vdp.oam[addr & 0x1FF], &value, 4);
+	write_tracked(&vdp.oam[addr & 0x1FF], &value, 4, vdp.mem_gen.oam);
 }
 
 uint8_t capture_read8(uint32_t addr)
@@ -374,6 +766,8 @@ uint8_t capture_read8(uint32_t addr)
 
 uint16_t capture_read16(uint32_t addr)
 {
+	Renderer::sync_capture();
+
 	addr &= 0x1FF;
 	uint16_t value;
 	memcpy(&value, &vdp.capture_buffer[addr], 2);
@@ -1001,18 +1395,7 @@ void dma_write8(uint32_t addr, uint8_t value)
 void dma_write16(uint32_t addr, uint16_t value)
 {
 	//Value written doesn't matter, it always triggers this
-	//TODO: how long does this take? Is the CPU stalled?
-	addr &= 0x3FF;
-
-	int y = addr >> 1;
-	for (int x = 0; x < DISPLAY_WIDTH; x++)
-	{
-		uint32_t addr = x + (y * DISPLAY_WIDTH);
-		uint8_t data = vdp.bitmap[addr];
-		data &= ~vdp.dma_mask;
-		data |= vdp.dma_value & vdp.dma_mask;
-		vdp.bitmap[addr] = data;
-	}
+	dma_fill(addr, 1);
 }
 
 void dma_write32(uint32_t addr, uint32_t value)
@@ -1020,4 +1403,26 @@ void dma_write32(uint32_t addr, uint32_t value)
 	assert(0);
 }
 
+void dma_fill(uint32_t addr, int count)
+{
+	//Each trigger fills one 256-byte line, and the line number wraps around every 512 lines
+	constexpr static int DMA_LINES = BITMAP_VRAM_SIZE / DISPLAY_WIDTH;
+
+	int line = (addr & 0x3FF) >> 1;
+	int lines_left = count;
+	while (lines_left > 0)
+	{
+		int lines = std::min(lines_left, DMA_LINES - line);
+		fill_bitmap_lines(line, lines);
+
+		line = 0;
+		lines_left -= lines;
+	}
+
+	//TODO: how long does this actually take? The CPU is assumed to be stalled while the VDP owns VRAM
+	//For now, guess one CPU cycle for each 16-bit read-modify-write of VRAM
+	constexpr static int STALL_CYCLES_PER_LINE = DISPLAY_WIDTH / 2;
+	Timing::stall(Timing::convert_cpu((int64_t)STALL_CYCLES_PER_LINE * count), Timing::CPU_TIMER);
+}
+
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <core/config.h>
+#include <core/timing.h>
 
 namespace Video
 {
@@ -9,6 +11,11 @@ constexpr static int DISPLAY_WIDTH = 0x100;
 //Output is always 240 lines tall, even in 224-line mode
 constexpr static int DISPLAY_HEIGHT = 0xF0;
 
+//A frame takes roughly 1/60 of a second
+constexpr static int LINES_PER_FRAME = 263;
+constexpr static int CYCLES_PER_LINE = (Timing::F_CPU / 60) / LINES_PER_FRAME;
+constexpr static int CYCLES_PER_FRAME = CYCLES_PER_LINE * LINES_PER_FRAME;
+
 constexpr static int BITMAP_VRAM_START = 0x04000000;
 constexpr static int BITMAP_VRAM_SIZE = 0x20000;
 constexpr static int BITMAP_VRAM_END = BITMAP_VRAM_START + BITMAP_VRAM_SIZE;
@@ -52,17 +59,67 @@ constexpr static int DMA_END = 0x04060000;
 
 constexpr static int OBJ_COUNT = 128;
 
-void initialize();
+enum class RenderMode
+{
+	Full, //Draw every frame
+	Skip, //Draw one frame, then skip the next skip_frames frames
+	None  //Never draw, only what the CPU can observe is emulated
+};
+
+//Pixel formats the display output can be drawn in, as packed host-endian values
+enum class DisplayFormat
+{
+	ARGB1555,
+	RGB565,
+	ARGB8888
+};
+
+int get_pixel_size(DisplayFormat format);
+
+void initialize(Config::VideoInfo& info);
 void shutdown();
 
-void start_frame();
+//Takes effect at the start of the next frame
+void set_render_mode(RenderMode mode, int skip_frames = 0);
+
+//Frames that aren't rendered, whatever the render mode, don't count towards frame skipping
+void start_frame(bool render = true);
 bool check_frame_end();
 
-uint16_t* get_display_output();
+//Whether the display output changed during the last frame
+bool display_changed();
+
+//Draws the display output in the given format, either to an internal buffer or straight into pixels
+//The caller's buffer must hold DISPLAY_HEIGHT rows of pitch bytes, and keep its contents between frames,
+//as lines that didn't change aren't drawn again
+void set_display_output(DisplayFormat format, void* pixels = nullptr, int pitch = 0);
+void* get_display_output();
+int get_display_pitch();
 
 void dump_for_serial();
 
+//VRAM, registers and the scanline timing, but not the display output, which is drawn again from them
+void save_state(Common::StateWriter& writer);
+void load_state(Common::StateReader& reader);
+
 //TODO: should these MMIO accessors be moved to a different file?
+//VRAM is mapped directly for reads, but writes go through these so the renderer knows which pages changed
+uint8_t bitmap_read8(uint32_t addr);
+uint16_t bitmap_read16(uint32_t addr);
+uint32_t bitmap_read32(uint32_t addr);
+
+void bitmap_write8(uint32_t addr, uint8_t value);
+void bitmap_write16(uint32_t addr, uint16_t value);
+void bitmap_write32(uint32_t addr, uint32_t value);
+
+uint8_t tile_read8(uint32_t addr);
+uint16_t tile_read16(uint32_t addr);
+uint32_t tile_read32(uint32_t addr);
+
+void tile_write8(uint32_t addr, uint8_t value);
+void tile_write16(uint32_t addr, uint16_t value);
+void tile_write32(uint32_t addr, uint32_t value);
+
 uint8_t palette_read8(uint32_t addr);
 uint16_t palette_read16(uint32_t addr);
 uint32_t palette_read32(uint32_t addr);
@@ -143,4 +200,7 @@ void dma_write8(uint32_t addr, uint8_t value);
 void dma_write16(uint32_t addr, uint16_t value);
 void dma_write32(uint32_t addr, uint32_t value);
 
+//Same as count consecutive 16-bit writes starting at addr, but the lines are filled in bulk
+void dma_fill(uint32_t addr, int count);
+
 }
\ No newline at end of file